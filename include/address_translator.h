@@ -0,0 +1,50 @@
+#ifndef BEETHOVENRUNTIME_ADDRESS_TRANSLATOR_H
+#define BEETHOVENRUNTIME_ADDRESS_TRANSLATOR_H
+
+#include <atomic>
+#include <cinttypes>
+#include <pthread.h>
+#include <set>
+#include <utility>
+
+/**
+ * FPGA -> host address translation for the allocations that the data server hands out. Mappings live in an ordered
+ * set, so a lookup is an upper_bound (O(log n)). In front of that, every thread has a small direct-mapped cache,
+ * indexed by 4KB page, of the mappings it recently hit. Streams through the same allocation, or a handful of
+ * interleaved ones, then translate in O(1) without touching the lock. Adding or removing a mapping bumps
+ * `generation`, which invalidates every cached entry at once.
+ */
+struct address_translator {
+  struct addr_pair {
+    uint64_t fpga_addr;
+    uint64_t mapping_length;
+    void *cpu_addr;
+
+    explicit addr_pair(uint64_t fpgaAddr, void *cpuAddr, uint64_t map_length) : fpga_addr(fpgaAddr), cpu_addr(cpuAddr), mapping_length(map_length) {}
+
+    bool operator<(const addr_pair &other) const {
+      return fpga_addr < other.fpga_addr;
+    }
+  };
+  std::set<addr_pair> mappings;
+  // mappings are added and removed by the data server thread while the simulation thread translates addresses
+  mutable pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+  // changes whenever `mappings` does. Starts at 1 so that a zeroed cache entry never looks valid
+  std::atomic<uint64_t> generation{1};
+
+  [[nodiscard]] void *translate(uint64_t fp_addr) const;
+  // The host address of `len` bytes at `fp_addr`, if they all lie in one mapping, or nullptr. Unlike translate(), a bad
+  // range is the caller's to report
+  [[nodiscard]] void *translate_range(uint64_t fp_addr, uint64_t len) const;
+  [[nodiscard]] std::pair<void *, uint64_t> get_mapping(uint64_t fpga_addr) const;
+  void add_mapping(uint64_t fpga_addr, uint64_t mapping_length, void *cpu_addr);
+  void remove_mapping(uint64_t fpga_addr);
+
+private:
+  // the mapping that contains `fp_addr`, or nullptr. Call with `lock` held
+  [[nodiscard]] const addr_pair *find(uint64_t fp_addr) const;
+};
+
+extern address_translator at;
+
+#endif //BEETHOVENRUNTIME_ADDRESS_TRANSLATOR_H
@@ -0,0 +1,22 @@
+#ifndef BEETHOVENRUNTIME_AFFINITY_H
+#define BEETHOVENRUNTIME_AFFINITY_H
+
+/**
+ * Keeps the simulation (the Verilator model's own worker threads included) and the runtime's service threads (cmd and
+ * data servers, response poller) on disjoint sets of cores, so that a multithreaded model doesn't get descheduled by
+ * the runtime, or the other way around.
+ *
+ * The core sets come from BEETHOVEN_MODEL_CPUS and BEETHOVEN_RUNTIME_CPUS (lists such as "0-7,16"). When they aren't
+ * given and the model was built with VERILATOR_THREADS=N, the model gets the first N cores and the runtime gets the
+ * rest. Otherwise, nothing is pinned.
+ */
+namespace affinity {
+  // Pin every thread that currently exists in this process to the model cores. Call this from the simulation thread
+  // after the model has been constructed and before any runtime service thread is started.
+  void pin_model_threads();
+
+  // Pin the calling thread to the runtime cores.
+  void pin_runtime_thread();
+}
+
+#endif //BEETHOVENRUNTIME_AFFINITY_H
@@ -0,0 +1,472 @@
+#ifndef BEETHOVENRUNTIME_CMD_RING_H
+#define BEETHOVENRUNTIME_CMD_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <beethoven/verilator_server.h>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "shm_futex.h"
+
+#ifndef CMD_RING_SLOTS
+#define CMD_RING_SLOTS 1024
+#endif
+
+#ifndef CMD_RING_MAX_CHANNELS
+#define CMD_RING_MAX_CHANNELS 32
+#endif
+
+constexpr uint64_t cmd_ring_pow2_at_least(uint64_t n) {
+  uint64_t p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+/**
+ * Lock-free command submission. Next to the cmd_server_file, the runtime serves a ring of rocc_cmd slots that any
+ * number of client threads/processes can push into without taking a lock, and that the runtime drains on its own
+ * thread. This replaces the server_mut/cmd_recieve_server_resp_lock hand-off, where every command costs several futex
+ * calls and one process unlocks a mutex that another one locked.
+ *
+ * The ring is a bounded multi-producer queue: every slot carries a sequence number that tells producers and the
+ * consumer whose turn it is (D. Vyukov's bounded MPMC queue, with a single consumer). The server only sleeps when the
+ * ring is empty, and producers only make a syscall to wake it when it is actually sleeping, so back-to-back commands
+ * never leave user space.
+ *
+ * Responses still come back through the cmd_server_file. A client that wants a response takes a handle from the
+ * cmd_server_file free list (cmd_ring::submit() does this) and then waits on it exactly like for a legacy submission.
+ * The main ring records which process holds each handle, so that the server can take back the handles of a client
+ * that dies.
+ *
+ * A batch of commands is claimed as a run of consecutive slots with one CAS and published first-slot-last, so the
+ * server always sees a batch in one piece and can deliver it under a single acquisition of its locks.
+ *
+ * Commands can instead ask for their responses to be posted to the ring's completion queue as (handle, response)
+ * records. Clients reap many completions at once, either by polling (lowest latency) or by sleeping on the completion
+ * queue's futex until at least one shows up. The completion queue has a slot for every response handle, so the server
+ * never has to wait for room.
+ *
+ * Clients that submit a lot can connect a channel of their own (cmd_ring::connect()): a private ring + completion
+ * queue in a segment of its own, registered in the main ring's channel registry. The server polls all channels
+ * round-robin, one batch per channel per round, so clients driving different cores don't serialize behind each other
+ * or behind a single chatty client. All channels share the main ring's doorbell, so the server still only sleeps on
+ * one futex.
+ */
+struct cmd_ring_file {
+  static constexpr uint32_t magic = 0xBEE7C0DE;
+  static constexpr uint64_t n_slots = CMD_RING_SLOTS;
+  static_assert((n_slots & (n_slots - 1)) == 0, "CMD_RING_SLOTS must be a power of two");
+  // larger batches are split up by the client
+  static constexpr int max_batch = n_slots / 4 > 64 ? 64 : int(n_slots / 4);
+  static_assert(max_batch >= 1, "CMD_RING_SLOTS is too small");
+  static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring indices must be lock-free to be shared");
+
+  struct slot {
+    std::atomic<uint64_t> seq;
+    int resp_id;
+    // number of commands in the batch that starts at this slot, and whether their responses go to the completion
+    // queue. Only meaningful in the first slot of a batch
+    int batch_len;
+    bool use_cq;
+    beethoven::rocc_cmd cmd;
+  };
+
+  static constexpr uint64_t n_response_handles =
+          sizeof(beethoven::cmd_server_file::responses) / sizeof(beethoven::rocc_response);
+
+  static constexpr uint64_t n_completions = cmd_ring_pow2_at_least(n_response_handles);
+
+  struct completion {
+    int handle;
+    beethoven::rocc_response response;
+  };
+
+  struct cq_slot {
+    std::atomic<uint64_t> seq;
+    completion c;
+  };
+
+  static constexpr int max_channels = CMD_RING_MAX_CHANNELS;
+
+  enum channel_state : uint32_t {
+    CHANNEL_FREE = 0,
+    // a client is setting up the channel's segment
+    CHANNEL_CLAIMED,
+    CHANNEL_ACTIVE,
+    // the client is gone. The server tears the channel down once it has no more responses to post to it
+    CHANNEL_CLOSING
+  };
+
+  struct channel_entry {
+    std::atomic<uint32_t> state;
+    // the client that claimed the channel. Set right after the claim, and cleared by the server when it frees the entry
+    std::atomic<int32_t> pid;
+  };
+
+  // set to `magic` once the server has initialized the ring
+  std::atomic<uint32_t> ready;
+  // next position producers will claim
+  alignas(64) std::atomic<uint64_t> tail;
+  // next position the server will consume. Only written by the server
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint32_t> server_sleeping;
+  // the word the server sleeps on. Producers bump it before waking the server
+  std::atomic<uint32_t> doorbell;
+  alignas(64) slot slots[n_slots];
+
+  // completion queue. Written only by the server, reaped by clients
+  alignas(64) std::atomic<uint64_t> cq_tail;
+  alignas(64) std::atomic<uint64_t> cq_head;
+  alignas(64) std::atomic<uint32_t> cq_waiters;
+  std::atomic<uint32_t> cq_doorbell;
+  alignas(64) cq_slot cq[n_completions];
+
+  // channel registry. Only used in the main ring. Bumped on every change so that the server knows to look
+  alignas(64) std::atomic<uint32_t> registry_generation;
+  channel_entry channel_registry[max_channels];
+
+  // which process holds each response handle that was taken through the helpers below (0 if none does). Only used in
+  // the main ring, and only changed under the cmd_server_file's free_list_lock. The server gives the handles of a
+  // process that died back to the free list
+  alignas(64) std::atomic<int32_t> handle_owner[n_response_handles];
+
+  static void init(cmd_ring_file &f) {
+    f.ready.store(0);
+    f.tail.store(0);
+    f.head.store(0);
+    f.server_sleeping.store(0);
+    f.doorbell.store(0);
+    for (uint64_t i = 0; i < n_slots; ++i) {
+      f.slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+    f.cq_tail.store(0);
+    f.cq_head.store(0);
+    f.cq_waiters.store(0);
+    f.cq_doorbell.store(0);
+    for (uint64_t i = 0; i < n_completions; ++i) {
+      f.cq[i].seq.store(i, std::memory_order_relaxed);
+    }
+    f.registry_generation.store(0);
+    for (auto &e: f.channel_registry) {
+      e.state.store(CHANNEL_FREE);
+      e.pid.store(0);
+    }
+    for (auto &o: f.handle_owner) o.store(0, std::memory_order_relaxed);
+    f.ready.store(magic, std::memory_order_release);
+  }
+
+  slot &at(uint64_t pos) { return slots[pos & (n_slots - 1)]; }
+
+  // wake the server up if it's sleeping. Only meaningful on the main ring
+  void wake_server() {
+    if (server_sleeping.load(std::memory_order_seq_cst)) {
+      doorbell.fetch_add(1);
+      shm_futex::wake(&doorbell);
+    }
+  }
+
+  // producer side. Post `n` (at most max_batch) commands as one batch. Returns false if there isn't room for all of
+  // them. `server` is the main ring, whose doorbell the server sleeps on, if this ring is a client channel
+  bool try_push_batch(const beethoven::rocc_cmd *cmds, const int *resp_ids, int n, bool use_cq = false,
+                      cmd_ring_file *server = nullptr) {
+    uint64_t pos = tail.load(std::memory_order_relaxed);
+    while (true) {
+      auto diff = int64_t(at(pos).seq.load(std::memory_order_acquire) - pos);
+      if (diff == 0) {
+        // the server frees slots in order, so if the last slot we need is free, so is everything before it
+        if (at(pos + n - 1).seq.load(std::memory_order_acquire) != pos + n - 1) return false;
+        if (tail.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    for (int i = 0; i < n; ++i) {
+      at(pos + i).cmd = cmds[i];
+      at(pos + i).resp_id = resp_ids[i];
+    }
+    at(pos).batch_len = n;
+    at(pos).use_cq = use_cq;
+    // publish the first slot last. Once the server sees it, it sees the whole batch
+    for (int i = n - 1; i >= 1; --i) {
+      at(pos + i).seq.store(pos + i + 1, std::memory_order_release);
+    }
+    at(pos).seq.store(pos + 1, std::memory_order_seq_cst);
+    (server ? server : this)->wake_server();
+    return true;
+  }
+
+  bool try_push(const beethoven::rocc_cmd &cmd, int resp_id, bool use_cq = false, cmd_ring_file *server = nullptr) {
+    return try_push_batch(&cmd, &resp_id, 1, use_cq, server);
+  }
+
+  // consumer (server) side. Take the next batch (room for max_batch commands). Returns its length, 0 if the ring is
+  // empty
+  int try_pop_batch(beethoven::rocc_cmd *cmds, int *resp_ids, bool &use_cq) {
+    uint64_t pos = head.load(std::memory_order_relaxed);
+    if (at(pos).seq.load(std::memory_order_acquire) != pos + 1) return 0;
+    int n = at(pos).batch_len;
+    use_cq = at(pos).use_cq;
+    for (int i = 0; i < n; ++i) {
+      cmds[i] = at(pos + i).cmd;
+      resp_ids[i] = at(pos + i).resp_id;
+    }
+    for (int i = 0; i < n; ++i) {
+      at(pos + i).seq.store(pos + i + n_slots, std::memory_order_release);
+    }
+    head.store(pos + n, std::memory_order_relaxed);
+    return n;
+  }
+
+  [[nodiscard]] bool looks_empty() const {
+    uint64_t pos = head.load(std::memory_order_relaxed);
+    return slots[pos & (n_slots - 1)].seq.load(std::memory_order_seq_cst) != pos + 1;
+  }
+
+  // consumer (server) side, on the main ring. Sleep until a producer rings the doorbell, unless `nothing_to_do()`,
+  // which must check every ring the server serves, says that something arrived in the meantime
+  template<typename F>
+  void wait_for_commands(uint64_t timeout_us, F nothing_to_do) {
+    uint32_t bell = doorbell.load();
+    server_sleeping.store(1, std::memory_order_seq_cst);
+    if (nothing_to_do()) shm_futex::wait(&doorbell, bell, timeout_us);
+    server_sleeping.store(0, std::memory_order_relaxed);
+  }
+
+  // server side. There is a completion slot for every response handle, so this never waits unless clients hold on
+  // to handles without reaping their completions
+  void complete(int handle, const beethoven::rocc_response &response) {
+    uint64_t pos = cq_tail.load(std::memory_order_relaxed);
+    cq_slot &s = cq[pos & (n_completions - 1)];
+    while (s.seq.load(std::memory_order_acquire) != pos) std::this_thread::yield();
+    s.c.handle = handle;
+    s.c.response = response;
+    s.seq.store(pos + 1, std::memory_order_seq_cst);
+    cq_tail.store(pos + 1, std::memory_order_relaxed);
+    if (cq_waiters.load(std::memory_order_seq_cst)) {
+      cq_doorbell.fetch_add(1);
+      shm_futex::wake(&cq_doorbell, INT32_MAX);
+    }
+  }
+
+  // client side. Reap up to `max` completions without blocking. Safe to call from many threads/processes at once
+  int poll_completions(completion *out, int max) {
+    int n = 0;
+    uint64_t pos = cq_head.load(std::memory_order_relaxed);
+    while (n < max) {
+      cq_slot &s = cq[pos & (n_completions - 1)];
+      auto diff = int64_t(s.seq.load(std::memory_order_acquire) - (pos + 1));
+      if (diff == 0) {
+        if (cq_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          out[n++] = s.c;
+          s.seq.store(pos + n_completions, std::memory_order_release);
+          pos++;
+        }
+      } else if (diff < 0) {
+        break;
+      } else {
+        pos = cq_head.load(std::memory_order_relaxed);
+      }
+    }
+    return n;
+  }
+
+  // client side. Reap up to `max` completions, sleeping until at least one is available or `timeout_us` microseconds
+  // have passed (0 means wait forever)
+  int wait_completions(completion *out, int max, uint64_t timeout_us = 0) {
+    int n = poll_completions(out, max);
+    if (n > 0) return n;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+    while (true) {
+      uint32_t bell = cq_doorbell.load();
+      cq_waiters.fetch_add(1, std::memory_order_seq_cst);
+      n = poll_completions(out, max);
+      if (n == 0) {
+        uint64_t left_us = 0;
+        if (timeout_us) {
+          auto now = std::chrono::steady_clock::now();
+          if (now >= deadline) {
+            cq_waiters.fetch_sub(1);
+            return 0;
+          }
+          left_us = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count() + 1;
+        }
+        shm_futex::wait(&cq_doorbell, bell, left_us);
+        n = poll_completions(out, max);
+      }
+      cq_waiters.fetch_sub(1);
+      if (n > 0) return n;
+    }
+  }
+};
+
+inline std::string cmd_ring_file_name(const std::string &instance_suffix = "") {
+  return beethoven::cmd_server_file_name() + "_ring" + instance_suffix;
+}
+
+inline std::string cmd_channel_file_name(int channel, const std::string &instance_suffix = "") {
+  return cmd_ring_file_name(instance_suffix) + "_ch" + std::to_string(channel);
+}
+
+// a client's private channel, see cmd_ring::connect()
+struct cmd_channel {
+  // the main ring, which holds the registry and the server's doorbell
+  cmd_ring_file *server;
+  cmd_ring_file *ring;
+  int index;
+};
+
+namespace cmd_ring {
+  inline cmd_ring_file *map_ring(const std::string &name, int flags) {
+    int fd = shm_open(name.c_str(), flags, beethoven::file_access_flags);
+    if (fd < 0) {
+      std::cerr << "Could not open command ring '" << name << "': " << strerror(errno) << std::endl;
+      return nullptr;
+    }
+    if ((flags & O_CREAT) && ftruncate(fd, sizeof(cmd_ring_file))) {
+      std::cerr << "Could not size command ring '" << name << "': " << strerror(errno) << std::endl;
+      close(fd);
+      return nullptr;
+    }
+    void *addr = mmap(nullptr, sizeof(cmd_ring_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return nullptr;
+    return (cmd_ring_file *) addr;
+  }
+
+  // Map the ring served by a running runtime. Returns nullptr if the runtime doesn't serve one
+  inline cmd_ring_file *open(const std::string &instance_suffix = "") {
+    auto ring = map_ring(cmd_ring_file_name(instance_suffix), O_RDWR);
+    if (ring == nullptr) return nullptr;
+    while (ring->ready.load(std::memory_order_acquire) != cmd_ring_file::magic) std::this_thread::yield();
+    return ring;
+  }
+
+  // Register a private channel with the server. Returns nullptr if the server isn't running or every channel is taken
+  inline cmd_channel *connect(const std::string &instance_suffix = "") {
+    auto server = open(instance_suffix);
+    if (server == nullptr) return nullptr;
+    for (int k = 0; k < cmd_ring_file::max_channels; ++k) {
+      auto &entry = server->channel_registry[k];
+      uint32_t expected = cmd_ring_file::CHANNEL_FREE;
+      if (!entry.state.compare_exchange_strong(expected, cmd_ring_file::CHANNEL_CLAIMED)) continue;
+      // so that the server can free the entry if we die before it's set up
+      entry.pid.store(getpid());
+      auto ring = map_ring(cmd_channel_file_name(k, instance_suffix), O_CREAT | O_RDWR);
+      if (ring == nullptr) {
+        entry.state.store(cmd_ring_file::CHANNEL_FREE);
+        break;
+      }
+      cmd_ring_file::init(*ring);
+      entry.state.store(cmd_ring_file::CHANNEL_ACTIVE);
+      server->registry_generation.fetch_add(1);
+      server->wake_server();
+      return new cmd_channel{server, ring, k};
+    }
+    std::cerr << "Could not register a command channel" << std::endl;
+    munmap(server, sizeof(cmd_ring_file));
+    return nullptr;
+  }
+
+  // Hand the channel back to the server. Responses that are still in flight are dropped. So are completions that
+  // haven't been reaped yet, and the server takes back their handles: don't release those yourself
+  inline void disconnect(cmd_channel *ch) {
+    ch->server->channel_registry[ch->index].state.store(cmd_ring_file::CHANNEL_CLOSING);
+    ch->server->registry_generation.fetch_add(1);
+    ch->server->wake_server();
+    munmap(ch->ring, sizeof(cmd_ring_file));
+    munmap(ch->server, sizeof(cmd_ring_file));
+    delete ch;
+  }
+
+  // Take a response handle from the free list, exactly like the server does for legacy submissions. `server` is the
+  // main ring, which records that this process holds the handle
+  inline int allocate_response_id(beethoven::cmd_server_file *csf, cmd_ring_file *server) {
+    auto pid = getpid();
+    pthread_mutex_lock(&csf->free_list_lock);
+    int id = csf->free_list[csf->free_list_idx];
+    csf->free_list_idx--;
+    server->handle_owner[id].store(pid, std::memory_order_relaxed);
+    pthread_mutex_unlock(&csf->free_list_lock);
+    return id;
+  }
+
+  // Response handles for every command of a batch that expects one, with a single trip through the free list lock.
+  // Commands that don't expect a response get 0xffff
+  inline void allocate_response_ids(beethoven::cmd_server_file *csf, cmd_ring_file *server,
+                                    std::vector<beethoven::rocc_cmd> &cmds, std::vector<int> &ids) {
+    ids.resize(cmds.size());
+    auto pid = getpid();
+    pthread_mutex_lock(&csf->free_list_lock);
+    for (size_t i = 0; i < cmds.size(); ++i) {
+      if (cmds[i].getXd()) {
+        ids[i] = csf->free_list[csf->free_list_idx];
+        csf->free_list_idx--;
+        server->handle_owner[ids[i]].store(pid, std::memory_order_relaxed);
+      } else {
+        ids[i] = 0xffff;
+      }
+    }
+    pthread_mutex_unlock(&csf->free_list_lock);
+  }
+
+  // Give a handle back once its response has been read
+  inline void release_response_id(beethoven::cmd_server_file *csf, cmd_ring_file *server, int id) {
+    pthread_mutex_lock(&csf->free_list_lock);
+    server->handle_owner[id].store(0, std::memory_order_relaxed);
+    csf->free_list_idx++;
+    csf->free_list[csf->free_list_idx] = id;
+    pthread_mutex_unlock(&csf->free_list_lock);
+  }
+
+  inline void release_response_id(beethoven::cmd_server_file *csf, cmd_channel *ch, int id) {
+    release_response_id(csf, ch->server, id);
+  }
+
+  // Post a command. Returns the response handle to wait on, or 0xffff if the command doesn't expect a response.
+  // With `use_cq`, the response is posted to the completion queue instead of unlocking the handle's mutex.
+  // Only spins if the ring is full
+  inline int submit(cmd_ring_file *ring, beethoven::cmd_server_file *csf, beethoven::rocc_cmd cmd,
+                    bool use_cq = false, cmd_ring_file *server = nullptr) {
+    int id = cmd.getXd() ? allocate_response_id(csf, server ? server : ring) : 0xffff;
+    while (!ring->try_push(cmd, id, use_cq, server)) std::this_thread::yield();
+    return id;
+  }
+
+  inline int submit(cmd_channel *ch, beethoven::cmd_server_file *csf, beethoven::rocc_cmd cmd, bool use_cq = false) {
+    return submit(ch->ring, csf, cmd, use_cq, ch->server);
+  }
+
+  // Post many commands at once and return their response handles (0xffff for commands that don't expect one), in
+  // order. Batches longer than cmd_ring_file::max_batch are posted as several consecutive batches
+  inline std::vector<int> submit_batch(cmd_ring_file *ring, beethoven::cmd_server_file *csf,
+                                       std::vector<beethoven::rocc_cmd> &cmds, bool use_cq = false,
+                                       cmd_ring_file *server = nullptr) {
+    std::vector<int> ids;
+    allocate_response_ids(csf, server ? server : ring, cmds, ids);
+    for (size_t off = 0; off < cmds.size(); off += cmd_ring_file::max_batch) {
+      int n = int(std::min(cmds.size() - off, size_t(cmd_ring_file::max_batch)));
+      while (!ring->try_push_batch(cmds.data() + off, ids.data() + off, n, use_cq, server))
+        std::this_thread::yield();
+    }
+    return ids;
+  }
+
+  inline std::vector<int> submit_batch(cmd_channel *ch, beethoven::cmd_server_file *csf,
+                                       std::vector<beethoven::rocc_cmd> &cmds, bool use_cq = false) {
+    return submit_batch(ch->ring, csf, cmds, use_cq, ch->server);
+  }
+}
+
+#endif //BEETHOVENRUNTIME_CMD_RING_H
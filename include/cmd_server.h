@@ -5,29 +5,88 @@
 #define BEETHOVEN_VERILATOR_CMD_SERVER_H
 
 #include <queue>
-#include <unordered_map>
 #include <beethoven/verilator_server.h>
+#include <beethoven_hardware.h>
+#include "cmd_ring.h"
+#include "spsc_queue.h"
 
 extern beethoven::cmd_server_file *csf;
 
-struct system_core_pair {
-  int system;
-  int core;
-  system_core_pair(int system, int core);
-  bool operator==(const system_core_pair &other) const {
-    return system == other.system and core == other.core;
+/**
+ * Response handles of the commands that are waiting on each (system, core), in the order they were sent. The hardware
+ * answers the commands of one core in order, so a response just takes the oldest handle of its core.
+ *
+ * Every (system, core) with commands in flight has a lane of its own with a preallocated queue, so routing a response
+ * needs neither an allocation nor a lock. Each queue has one producer, the command server (which delivers under
+ * cmdserverlock), and one consumer, whoever calls register_reponse(). A handle is always pushed before its command
+ * is handed to the hardware, so the response can never overtake it.
+ *
+ * Every command in flight holds a response handle, so no more (system, core)s than there are handles can have
+ * commands in flight at once, and no queue can hold more than all of them. With that many lanes that deep, push()
+ * always succeeds, whatever system and core ids the design uses: a lane whose queue has drained is handed to the next
+ * (system, core) that needs one.
+ */
+struct in_flight_table {
+  static constexpr uint64_t n_lanes = cmd_ring_file::n_response_handles;
+  static constexpr size_t depth = cmd_ring_pow2_at_least(cmd_ring_file::n_response_handles);
+
+  struct lane {
+    // which (system, core) the lane belongs to right now. Only the producer changes it, and only while it's empty
+    std::atomic<uint64_t> key{0};
+    spsc_queue<uint16_t, depth> queue;
+  };
+  lane lanes[n_lanes];
+  // lanes [0, n_used) have been handed out at some point
+  std::atomic<uint64_t> n_used{0};
+
+  static uint64_t key_of(int system, int core) {
+    return uint64_t(uint32_t(system)) << 32 | uint32_t(core);
   }
-};
 
-template <>
-struct std::hash<system_core_pair> {
-  std::size_t operator()(const system_core_pair& k) const
-  {
-    return k.core << 8 | k.system;
+  bool push(int system, int core, int id) {
+    auto key = key_of(system, core);
+    auto n = n_used.load(std::memory_order_relaxed);
+    lane *idle = nullptr;
+    for (uint64_t i = 0; i < n; ++i) {
+      if (lanes[i].key.load(std::memory_order_relaxed) == key) return lanes[i].queue.try_push(uint16_t(id));
+      // a drained lane can't be the target of any response until someone pushes to it again
+      if (idle == nullptr && lanes[i].queue.empty()) idle = &lanes[i];
+    }
+    if (idle == nullptr) {
+      if (n == n_lanes) return false;
+      idle = &lanes[n];
+      idle->key.store(key, std::memory_order_release);
+      n_used.store(n + 1, std::memory_order_release);
+    } else {
+      idle->key.store(key, std::memory_order_release);
+    }
+    return idle->queue.try_push(uint16_t(id));
   }
 
+  bool pop(int system, int core, int &id) {
+    auto key = key_of(system, core);
+    auto n = n_used.load(std::memory_order_acquire);
+    for (uint64_t i = 0; i < n; ++i) {
+      if (lanes[i].key.load(std::memory_order_acquire) != key) continue;
+      uint16_t v;
+      if (!lanes[i].queue.try_pop(v)) return false;
+      id = v;
+      return true;
+    }
+    return false;
+  }
+
+  [[nodiscard]] bool empty() const {
+    auto n = n_used.load(std::memory_order_acquire);
+    for (uint64_t i = 0; i < n; ++i) {
+      if (!lanes[i].queue.empty()) return false;
+    }
+    return true;
+  }
 };
 
+extern in_flight_table in_flight;
+
 struct cmd_server {
   static void start();
   ~cmd_server();
@@ -0,0 +1,379 @@
+#ifndef BEETHOVENRUNTIME_DATA_RING_H
+#define BEETHOVENRUNTIME_DATA_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <beethoven/verilator_server.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#include "shm_futex.h"
+
+#ifndef DATA_RING_SLOTS
+#define DATA_RING_SLOTS 256
+#endif
+
+#ifndef DATA_RING_TOKENS
+#define DATA_RING_TOKENS 1024
+#endif
+
+// Ops that only the ring serves, numbered well clear of data_server_op.
+//
+// Scatter-gather moves copy many ranges in one request. args[0] is the device address of an allocation that holds
+// args[1] sg_descriptors, and each one copies `len` bytes between the device at `fpga_addr` and the host side of
+// (args[2] + host_offset). So with args[2] = 0 and host_offset = fpga_addr, every range moves between an allocation's
+// host and device copies, like MOVE_TO/FROM_FPGA. Ranges that continue where the previous one stopped are coalesced.
+// The list and every range must lie inside one allocation each, or nothing moves and the status is EFAULT. Simulated
+// DMA only moves multiples of 64B (EINVAL otherwise), counted after coalescing.
+//
+// REGISTER_BUFFER gives the device access to memory that the client already has, without a copy. The client first
+// passes a file that it has open read-write (a regular file or a memfd) over the ring's socket and gets a cookie back
+// (see register_fd()). Then args[0] is the number of bytes, args[1] the page-aligned offset in the file and args[2] the
+// cookie. The server maps the file shared and answers with the device address in args[0], like ALLOC, so the client and
+// device see each other's writes. Release it with FREE like any allocation.
+//
+// FILL_FPGA and COPY_FPGA clear or duplicate device memory without staging it through the host: args[2] bytes at the
+// device address args[0] are set to the byte value args[1] (FILL_FPGA), or copied from the device address args[1]
+// (COPY_FPGA). Each range must lie inside one allocation (EFAULT otherwise), and the two ranges of a copy must not
+// overlap (EINVAL). Only the device side changes, like after a MOVE_TO_FPGA, so copy the result back with
+// MOVE_FROM_FPGA if the host needs to see it.
+enum data_ring_op : uint32_t {
+  MOVE_SG_TO_FPGA = 0x100,
+  MOVE_SG_FROM_FPGA,
+  REGISTER_BUFFER,
+  FILL_FPGA,
+  COPY_FPGA
+};
+
+struct sg_descriptor {
+  uint64_t fpga_addr;
+  uint64_t host_offset;
+  uint64_t len;
+};
+
+/**
+ * Asynchronous data server ops. The data_server_file hand-off serves one op at a time, so a long MOVE_TO_FPGA holds
+ * up every other client's allocations. Next to it, the runtime serves this segment: clients claim a completion token,
+ * write an ALLOC, FREE or MOVE_* op into it and post the token to one of two queues. One server thread works through
+ * allocations and frees, and a small pool of workers (BEETHOVEN_DATA_WORKERS, default 2) through data movement, so
+ * transfers and allocations from different clients proceed concurrently. The client can go on with other work and
+ * later test or wait on its token. A FREE waits for the moves already running on its allocation, and any that reach the
+ * server after it fail with EFAULT.
+ *
+ * A token carries the op's arguments in, and its results back out, in the same fields as the data_server_file:
+ * arg[0..2] are op_argument, op2_argument and op3_argument, and `fname` is fname. Ops that can fail also say whether
+ * they did in `status`. The data_server_file has no such field, so an op that fails there comes back with all three
+ * arguments zeroed, and the runtime logs why.
+ *
+ * The queues are bounded multi-producer/multi-consumer queues of token indices (the same sequence-numbered slots as the
+ * command ring), and nobody makes a futex call unless someone is actually asleep on the other side.
+ */
+struct data_ring_file {
+  static constexpr uint32_t magic = 0xBEE7DA7A;
+  static constexpr uint64_t n_slots = DATA_RING_SLOTS;
+  static_assert((n_slots & (n_slots - 1)) == 0, "DATA_RING_SLOTS must be a power of two");
+  static constexpr uint32_t n_tokens = DATA_RING_TOKENS;
+
+  enum queue_id {
+    // ALLOC, FREE and REGISTER_BUFFER
+    QUEUE_MANAGE,
+    // MOVE_TO_FPGA, MOVE_FROM_FPGA, the scatter-gather moves, FILL_FPGA and COPY_FPGA
+    QUEUE_MOVE,
+    N_QUEUES
+  };
+
+  enum token_state : uint32_t {
+    TOKEN_FREE = 0,
+    // a client is filling in the op
+    TOKEN_CLAIMED,
+    TOKEN_PENDING,
+    TOKEN_DONE
+  };
+
+  struct token {
+    std::atomic<uint32_t> state;
+    std::atomic<uint32_t> waiters;
+    uint32_t op;
+    // 0 once the op has succeeded, or an errno value saying why it failed
+    int32_t status;
+    uint64_t arg[3];
+    char fname[256];
+  };
+
+  struct queue {
+    struct slot {
+      std::atomic<uint64_t> seq;
+      uint32_t token;
+    };
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint32_t> sleepers;
+    std::atomic<uint32_t> doorbell;
+    alignas(64) slot slots[n_slots];
+
+    void init() {
+      tail.store(0);
+      head.store(0);
+      sleepers.store(0);
+      doorbell.store(0);
+      for (uint64_t i = 0; i < n_slots; ++i) slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(uint32_t t) {
+      uint64_t pos = tail.load(std::memory_order_relaxed);
+      while (true) {
+        auto &s = slots[pos & (n_slots - 1)];
+        auto diff = int64_t(s.seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+          if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            s.token = t;
+            s.seq.store(pos + 1, std::memory_order_seq_cst);
+            break;
+          }
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = tail.load(std::memory_order_relaxed);
+        }
+      }
+      if (sleepers.load(std::memory_order_seq_cst)) {
+        doorbell.fetch_add(1);
+        shm_futex::wake(&doorbell);
+      }
+      return true;
+    }
+
+    bool try_pop(uint32_t &t) {
+      uint64_t pos = head.load(std::memory_order_relaxed);
+      while (true) {
+        auto &s = slots[pos & (n_slots - 1)];
+        auto diff = int64_t(s.seq.load(std::memory_order_acquire) - (pos + 1));
+        if (diff == 0) {
+          if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            t = s.token;
+            s.seq.store(pos + n_slots, std::memory_order_release);
+            return true;
+          }
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = head.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    // server side. Pop the next token, sleeping while the queue is empty
+    uint32_t pop() {
+      uint32_t t;
+      while (true) {
+        if (try_pop(t)) return t;
+        uint32_t bell = doorbell.load();
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        if (!try_pop(t)) {
+          shm_futex::wait(&doorbell, bell);
+          sleepers.fetch_sub(1);
+          continue;
+        }
+        sleepers.fetch_sub(1);
+        return t;
+      }
+    }
+  };
+
+  // set to `magic` once the server has initialized the ring
+  std::atomic<uint32_t> ready;
+  // where the next token search starts, so that clients don't all fight over the first free one
+  alignas(64) std::atomic<uint32_t> token_hint;
+  queue queues[N_QUEUES];
+  alignas(64) token tokens[n_tokens];
+
+  static void init(data_ring_file &f) {
+    f.ready.store(0);
+    f.token_hint.store(0);
+    for (auto &q: f.queues) q.init();
+    for (auto &t: f.tokens) {
+      t.state.store(TOKEN_FREE, std::memory_order_relaxed);
+      t.waiters.store(0, std::memory_order_relaxed);
+    }
+    f.ready.store(magic, std::memory_order_release);
+  }
+
+  static queue_id queue_for(uint32_t op) {
+    return op == beethoven::data_server_op::MOVE_TO_FPGA || op == beethoven::data_server_op::MOVE_FROM_FPGA ||
+           op == MOVE_SG_TO_FPGA || op == MOVE_SG_FROM_FPGA || op == FILL_FPGA || op == COPY_FPGA
+           ? QUEUE_MOVE : QUEUE_MANAGE;
+  }
+
+  // server side. Hand the results back to whoever is waiting on `t`
+  void complete(uint32_t t) {
+    auto &tok = tokens[t];
+    tok.state.store(TOKEN_DONE, std::memory_order_seq_cst);
+    if (tok.waiters.load(std::memory_order_seq_cst)) shm_futex::wake(&tok.state, INT32_MAX);
+  }
+};
+
+inline std::string data_ring_file_name(const std::string &instance_suffix = "") {
+  return beethoven::data_server_file_name() + "_ring" + instance_suffix;
+}
+
+namespace data_ring {
+  // Map the ring served by a running runtime. Returns nullptr if the runtime doesn't serve one
+  inline data_ring_file *open(const std::string &instance_suffix = "") {
+    auto name = data_ring_file_name(instance_suffix);
+    int fd = shm_open(name.c_str(), O_RDWR, beethoven::file_access_flags);
+    if (fd < 0) {
+      std::cerr << "Could not open data ring '" << name << "': " << strerror(errno) << std::endl;
+      return nullptr;
+    }
+    void *addr = mmap(nullptr, sizeof(data_ring_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return nullptr;
+    auto ring = (data_ring_file *) addr;
+    while (ring->ready.load(std::memory_order_acquire) != data_ring_file::magic) std::this_thread::yield();
+    return ring;
+  }
+
+  // Post an op and return its completion token. Only spins if every token is taken or the queue is full
+  inline uint32_t submit(data_ring_file *ring, uint32_t op, uint64_t arg0, uint64_t arg1 = 0, uint64_t arg2 = 0) {
+    uint32_t t = ring->token_hint.fetch_add(1, std::memory_order_relaxed) % data_ring_file::n_tokens;
+    while (true) {
+      uint32_t expected = data_ring_file::TOKEN_FREE;
+      if (ring->tokens[t].state.compare_exchange_strong(expected, data_ring_file::TOKEN_CLAIMED)) break;
+      t = (t + 1) % data_ring_file::n_tokens;
+      if (t == 0) std::this_thread::yield();
+    }
+    auto &tok = ring->tokens[t];
+    tok.op = op;
+    tok.arg[0] = arg0;
+    tok.arg[1] = arg1;
+    tok.arg[2] = arg2;
+    tok.status = 0;
+    tok.state.store(data_ring_file::TOKEN_PENDING, std::memory_order_release);
+    while (!ring->queues[data_ring_file::queue_for(op)].try_push(t)) std::this_thread::yield();
+    return t;
+  }
+
+  // Start copying `len` bytes of the allocation at `fpga_addr` to the device and return right away, so that the copy
+  // overlaps with whatever the accelerator or the client does in the meantime. The token is tested, waited on and
+  // released like any other
+  inline uint32_t copy_to_fpga(data_ring_file *ring, uint64_t fpga_addr, uint64_t len) {
+    return submit(ring, beethoven::data_server_op::MOVE_TO_FPGA, fpga_addr, 0, len);
+  }
+
+  // the other direction, see copy_to_fpga()
+  inline uint32_t copy_from_fpga(data_ring_file *ring, uint64_t fpga_addr, uint64_t len) {
+    return submit(ring, beethoven::data_server_op::MOVE_FROM_FPGA, 0, fpga_addr, len);
+  }
+
+  // Start a scatter-gather copy of the `n` sg_descriptors in the allocation at `list_addr`. Their host offsets are
+  // relative to `host_base`
+  inline uint32_t copy_sg_to_fpga(data_ring_file *ring, uint64_t list_addr, uint64_t n, uint64_t host_base = 0) {
+    return submit(ring, MOVE_SG_TO_FPGA, list_addr, n, host_base);
+  }
+
+  inline uint32_t copy_sg_from_fpga(data_ring_file *ring, uint64_t list_addr, uint64_t n, uint64_t host_base = 0) {
+    return submit(ring, MOVE_SG_FROM_FPGA, list_addr, n, host_base);
+  }
+
+  // Start setting `len` bytes of device memory at `fpga_addr` to `value`
+  inline uint32_t fill(data_ring_file *ring, uint64_t fpga_addr, uint8_t value, uint64_t len) {
+    return submit(ring, FILL_FPGA, fpga_addr, value, len);
+  }
+
+  // Start copying `len` bytes of device memory from `src_addr` to `dst_addr`
+  inline uint32_t copy_on_fpga(data_ring_file *ring, uint64_t dst_addr, uint64_t src_addr, uint64_t len) {
+    return submit(ring, COPY_FPGA, dst_addr, src_addr, len);
+  }
+
+  // where the server takes file descriptors for REGISTER_BUFFER, in the abstract socket namespace
+  inline std::pair<sockaddr_un, socklen_t> fd_socket_address(const std::string &instance_suffix = "") {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    auto name = data_ring_file_name(instance_suffix) + "_fds";
+    auto len = std::min(name.size(), sizeof(addr.sun_path) - 1);
+    memcpy(addr.sun_path + 1, name.data(), len);
+    return {addr, socklen_t(offsetof(sockaddr_un, sun_path) + 1 + len)};
+  }
+
+  // Hand `fd` to the server and return the cookie that names it in REGISTER_BUFFER, or 0 if that didn't work
+  inline uint64_t pass_fd(int fd, const std::string &instance_suffix = "") {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return 0;
+    auto addr = fd_socket_address(instance_suffix);
+    uint64_t cookie = 0;
+    if (connect(sock, (sockaddr *) &addr.first, addr.second) == 0) {
+      char byte = 0;
+      iovec iov{&byte, 1};
+      alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+      msghdr msg{};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      auto c = CMSG_FIRSTHDR(&msg);
+      c->cmsg_level = SOL_SOCKET;
+      c->cmsg_type = SCM_RIGHTS;
+      c->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(c), &fd, sizeof(int));
+      if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1 ||
+          recv(sock, &cookie, sizeof(cookie), MSG_WAITALL) != sizeof(cookie)) {
+        cookie = 0;
+      }
+    }
+    close(sock);
+    return cookie;
+  }
+
+  // Start registering `len` bytes at `offset` of the file that this process has open read-write as `fd` (e.g. a
+  // memfd_create() buffer) with the device. Once the token is done, its arg[0] is the buffer's device address, or its
+  // status says why there isn't one
+  inline uint32_t register_fd(data_ring_file *ring, int fd, uint64_t len, uint64_t offset = 0,
+                              const std::string &instance_suffix = "") {
+    return submit(ring, REGISTER_BUFFER, len, offset, pass_fd(fd, instance_suffix));
+  }
+
+  // same, for the file at `path`, which is opened with this process's permissions
+  inline uint32_t register_buffer(data_ring_file *ring, const std::string &path, uint64_t len, uint64_t offset = 0,
+                                  const std::string &instance_suffix = "") {
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    auto t = register_fd(ring, fd, len, offset, instance_suffix);
+    if (fd >= 0) close(fd);
+    return t;
+  }
+
+  // has the op behind `t` finished?
+  inline bool test(data_ring_file *ring, uint32_t t) {
+    return ring->tokens[t].state.load(std::memory_order_acquire) == data_ring_file::TOKEN_DONE;
+  }
+
+  // Wait for the op behind `t` to finish. Its results are then in ring->tokens[t] until release()
+  inline void wait(data_ring_file *ring, uint32_t t) {
+    auto &tok = ring->tokens[t];
+    for (int spin = 0; spin < 1000; ++spin) {
+      if (test(ring, t)) return;
+    }
+    while (true) {
+      auto state = tok.state.load(std::memory_order_acquire);
+      if (state == data_ring_file::TOKEN_DONE) return;
+      tok.waiters.fetch_add(1, std::memory_order_seq_cst);
+      if (tok.state.load(std::memory_order_seq_cst) == state) shm_futex::wait(&tok.state, state);
+      tok.waiters.fetch_sub(1);
+    }
+  }
+
+  // give a finished token back
+  inline void release(data_ring_file *ring, uint32_t t) {
+    ring->tokens[t].state.store(data_ring_file::TOKEN_FREE, std::memory_order_release);
+  }
+}
+
+#endif //BEETHOVENRUNTIME_DATA_RING_H
@@ -6,17 +6,50 @@
 #define BEETHOVEN_VERILATOR_DATA_SERVER_H
 
 #include <cmath>
+#include <pthread.h>
 #include <beethoven_hardware.h>
 #include <queue>
-#include <set>
 #include "util.h"
+#include "address_translator.h"
 #include <beethoven/verilator_server.h>
 
 #if defined(SIM)
 #if defined(BEETHOVEN_HAS_DMA)
+#include <atomic>
+#include <deque>
 #include <pthread.h>
+
+// One burst for the simulated DMA port. The data server queues up every burst of a transfer at once and the simulation
+// works through them back-to-back, so transfers don't wait on a round trip to the data server thread between bursts,
+// and transfers from several workers can be queued up behind each other.
+//
+// FILL_FPGA and COPY_FPGA go through the same queue but never reach the design: there's no device-side engine to drive,
+// so the simulation applies them straight to the backing store, after holding the DMA port for as many cycles as moving
+// the bytes over it would take.
+enum dma_kind {
+  DMA_MOVE,
+  // set `len` bytes at `ptr` to `fill_value`
+  DMA_FILL,
+  // copy `len` bytes from `src` to `ptr`
+  DMA_COPY
+};
+
+struct dma_descriptor {
+  unsigned char *ptr;
+  uint64_t fpga_addr;
+  size_t len;
+  bool write;
+  // counts down as the transfer's bursts finish. Whoever queued them sleeps on it until it reaches 0
+  std::atomic<uint32_t> *bursts_left;
+  dma_kind kind = DMA_MOVE;
+  const unsigned char *src = nullptr;
+  int fill_value = 0;
+};
+
+// everything below is guarded by dma_lock
 extern pthread_mutex_t dma_lock;
-extern pthread_mutex_t dma_wait_lock;
+extern std::deque<dma_descriptor> dma_queue;
+extern std::atomic<uint32_t> *dma_bursts_left;
 extern bool dma_valid;
 extern unsigned char *dma_ptr;
 extern uint64_t dma_fpga_addr;
@@ -29,33 +62,16 @@ extern bool dma_in_progress;
 
 struct data_server {
   static void start();
+  // Give every live allocation a shared segment of its own, named after the original with shm_instance_suffix appended,
+  // and copy its contents there. Used by snapshot sweep children so that their writes don't leak into the parent's or
+  // their siblings' memory, while their clients can still map the allocations. The names are also written to
+  // allocations<suffix>.txt
+  static void copy_allocations_for_sweep();
   ~data_server();
 };
 
-extern beethoven::data_server_file *dsf;
-
-struct address_translator {
-  struct addr_pair {
-    uint64_t fpga_addr;
-    uint64_t mapping_length;
-    void *cpu_addr;
-
-    explicit addr_pair(uint64_t fpgaAddr, void *cpuAddr, uint64_t map_length) : fpga_addr(fpgaAddr), cpu_addr(cpuAddr), mapping_length(map_length) {}
-
-    bool operator<(const addr_pair &other) const {
-      return fpga_addr < other.fpga_addr;
-    }
-  };
-  std::set<addr_pair> mappings;
-
-  [[nodiscard]] void *translate(uint64_t fp_addr) const;
-  [[nodiscard]] std::pair<void *, uint64_t> get_mapping(uint64_t fpga_addr) const;
-  void add_mapping(uint64_t fpga_addr, uint64_t mapping_length, void *cpu_addr);
-  void remove_mapping(uint64_t fpga_addr);
-};
-
-
-extern address_translator at;
+extern pthread_rwlock_t data_server_busy;
 
+extern beethoven::data_server_file *dsf;
 
 #endif//BEETHOVEN_VERILATOR_DATA_SERVER_H
@@ -43,9 +43,17 @@ extern "C" {
 #endif
 
 
+// the XDMA engine has up to 4 H2C and 4 C2H channels
+#define XDMA_MAX_CHANNELS 4
+
 extern int pci_bar_handle;
+// channel 0
 extern int xdma_write_fd;
 extern int xdma_read_fd;
+// every channel that fpga_setup() opened (BEETHOVEN_XDMA_CHANNELS, default all of them)
+extern int xdma_n_channels;
+extern int xdma_write_fds[XDMA_MAX_CHANNELS];
+extern int xdma_read_fds[XDMA_MAX_CHANNELS];
 
 
 void check_rc(int rc, const char *message);
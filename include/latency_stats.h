@@ -0,0 +1,63 @@
+#ifndef BEETHOVENRUNTIME_LATENCY_STATS_H
+#define BEETHOVENRUNTIME_LATENCY_STATS_H
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+
+/**
+ * Wall-clock breakdown of where the latency of a command goes between the runtime receiving it and handing its
+ * response back. Every stage keeps a log2(ns) histogram of plain atomic counters, so recording from any thread is a
+ * couple of relaxed adds and reading them never stops the runtime. Send SIGUSR1 (with the response poller running)
+ * to print them.
+ *
+ * The moment that a response shows up in hardware isn't observable, only the poller's peeks are. A response is
+ * considered to have appeared right after the poller's last peek that came back empty (or when it started looking).
+ * Everything before that counts as hardware time, everything after as detection delay. So a response that waited
+ * behind an earlier one is charged to the hardware, and a poller sleeping through one is charged to detection.
+ */
+namespace latency_stats {
+  enum stage {
+    // waiting for cmdserverlock before a command (or batch) can be delivered
+    STAGE_CMD_LOCK_WAIT,
+    // waiting for the MMIO bus lock (held by the response poller while it reads)
+    STAGE_BUS_LOCK_WAIT,
+    // pushing one command over MMIO, including spinning on CMD_READY
+    STAGE_MMIO_PUSH,
+    // command delivered -> response available
+    STAGE_HW_EXEC,
+    // response available -> poller saw RESP_VALID
+    STAGE_POLL_DETECT,
+    // reading the response words off the bus
+    STAGE_RESP_READ,
+    // register_reponse(): finding the response's handle and storing it, up to handing it back
+    STAGE_REGISTER,
+    // command received -> response handed back
+    STAGE_END_TO_END,
+    N_STAGES
+  };
+
+  inline uint64_t now_ns() {
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void record(stage s, uint64_t ns);
+
+  // timestamps of the command that owns response handle `id`
+  void command_received(int id, uint64_t t_ns);
+
+  void command_delivered(int id, uint64_t t_ns);
+
+  // The poller has read a response. It started looking at `looking_since`, its last empty peek was at `last_miss`
+  // (0 if there was none) and it saw RESP_VALID at `detected`. Consumed by the next response_routed() on this thread
+  void response_seen(uint64_t looking_since, uint64_t last_miss, uint64_t detected);
+
+  // register_reponse() figured out that the response it was called with (at `start`) belongs to handle `id`. Must be
+  // called before the handle goes back to its owner, who may reuse it (and its timestamps) right away
+  void response_routed(int id, uint64_t start);
+
+  void report(FILE *f);
+}
+
+#endif //BEETHOVENRUNTIME_LATENCY_STATS_H
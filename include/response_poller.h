@@ -7,6 +7,7 @@
 
 #ifndef SIM
 
+#include <cstdio>
 #include <pthread.h>
 #include <semaphore.h>
 #include <beethoven/verilator_server.h>
@@ -14,8 +15,18 @@
 
 extern beethoven::cmd_server_file *csf;
 
+/**
+ * Reads responses off the MMIO response queue. Every post on the semaphore means one more response is owed. The poller
+ * spins on RESP_VALID for BEETHOVEN_POLL_SPIN peeks, then sleeps with exponential backoff between
+ * BEETHOVEN_POLL_MIN_US and BEETHOVEN_POLL_MAX_US, and drains every owed response before it goes back to waiting on
+ * the semaphore. Send SIGUSR1 to print latency and CPU statistics, along with the per-stage command latency breakdown
+ * (see latency_stats.h). BEETHOVEN_STATS_SIGNAL picks another signal number (0 turns reporting off), and reporting
+ * stays off if something else in the process already handles the signal.
+ */
 struct response_poller {
   static void start_poller(sem_t *t);
+
+  static void report(FILE *f);
 };
 
 #endif
@@ -0,0 +1,115 @@
+#ifndef BEETHOVENRUNTIME_SHM_ARENA_H
+#define BEETHOVENRUNTIME_SHM_ARENA_H
+
+#include <cinttypes>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Pooled shared-memory backing for device allocations. Without it, every ALLOC creates, truncates and maps a segment
+ * of its own, so a workload with many buffers pays a few syscalls per buffer and the client maps each one separately.
+ * With BEETHOVEN_SHM_ARENA=<MB> set, the data server instead carves allocations out of a few large, sparse segments
+ * (arenas) of at least that size, and a client maps every arena only once.
+ *
+ * Nothing is zeroed up front: a new arena reads as zero anyway, and freeing an allocation punches a hole in the arena
+ * file, which hands its pages back to the kernel and makes them read as zero again the next time they're handed out.
+ *
+ * The ALLOC response differs when arenas are on: `fname` names the arena, `op2_argument` is the allocation's offset in
+ * it and `op3_argument` is the size of the whole arena. Clients must go through shm_arena::client_map(). The name comes
+ * with response_prefix in front, so that a client that doesn't know about arenas fails to shm_open() it, instead of
+ * mapping the start of the arena and silently using someone else's memory.
+ *
+ * Allocations of 2MB or more can be backed by huge pages, so that a simulation streaming through a multi-GB dataset
+ * doesn't take a TLB miss (and, the first time, a page fault) every 4KB. BEETHOVEN_HUGEPAGES picks how:
+ *  - "hugetlb": arenas in a hugetlbfs mount (BEETHOVEN_HUGETLBFS, default /dev/hugepages). Needs huge pages to have
+ *               been reserved (vm.nr_hugepages) and arenas to be on, as clients can't shm_open() a hugetlbfs file.
+ *               `fname` is then a full path
+ *  - "thp":     regular shm, mapped 2MB-aligned and advised for transparent huge pages. Only gets them if
+ *               /sys/kernel/mm/transparent_hugepage/shmem_enabled is "advise" (or /dev/shm is mounted with huge=)
+ *  - "off":     (default) 4KB pages
+ * If hugetlb pages can't be had, we fall back to thp, and thp silently degrades to 4KB pages.
+ */
+namespace shm_arena {
+  // small allocations are handed out in multiples of this, huge page backed ones in multiples of huge_page_bytes
+  const uint64_t granule = 4096;
+  const uint64_t huge_page_bytes = 2 << 20;
+
+  // see above. shm_open() refuses any name with a '/' past its leading ones
+  constexpr const char *response_prefix = "arena:";
+
+  enum page_kind {
+    PAGES_SMALL,
+    PAGES_THP,
+    PAGES_HUGETLB
+  };
+
+  // the BEETHOVEN_SHM_ARENA size in bytes, or 0 when arenas are off
+  uint64_t arena_bytes();
+
+  // what BEETHOVEN_HUGEPAGES asks for
+  page_kind requested_pages();
+
+  // Map `size` bytes of the segment open at `fd`, shared. For PAGES_THP, the mapping is 2MB-aligned and advised for
+  // transparent huge pages. Returns MAP_FAILED on failure
+  void *map_segment(int fd, uint64_t size, page_kind kind);
+
+  // open an arena or allocation segment by the name the data server handed out
+  inline int open_segment(const std::string &name, int flags = O_RDWR) {
+    // shm names have a single leading slash, hugetlbfs arenas are full paths
+    if (name.find('/', 1) != std::string::npos) return open(name.c_str(), flags, S_IRUSR | S_IWUSR);
+    return shm_open(name.c_str(), flags, S_IRUSR | S_IWUSR);
+  }
+
+  struct allocation {
+    std::string name;
+    uint64_t offset;
+    uint64_t arena_size;
+    void *cpu_addr;
+  };
+
+  // Carve `nBytes` out of an arena, opening a new one when none has room (an allocation larger than
+  // BEETHOVEN_SHM_ARENA gets an arena of its own)
+  allocation alloc(uint64_t nBytes);
+
+  // Give an allocation back. Returns false if `cpu_addr` isn't the start of an arena allocation
+  bool free(void *cpu_addr);
+
+  // The arena segment and offset backing `cpu_addr`, if it's an arena allocation
+  bool lookup(void *cpu_addr, std::string &name, uint64_t &offset);
+
+  // Stop handing out (or punching holes in) the arenas that exist now. Used by snapshot sweep children, which copy
+  // their allocations into segments of their own and must never touch the parent's files
+  void detach();
+
+  // Remove the files of every arena we own (not the detached ones), so that hugetlbfs arenas give their huge pages back
+  // once the last mapping goes away. Runs at exit once a hugetlbfs arena has been opened
+  void unlink_all();
+
+  // Client side: map the arena named `fname` in an ALLOC response (once per process) and return the address of
+  // `offset` in it. Names without response_prefix, like the ones that sweep children list, are taken as they are
+  inline void *client_map(const char *fname, uint64_t offset, uint64_t arena_size) {
+    static std::mutex mut;
+    static std::map<std::string, char *> mapped;
+    std::string name = fname;
+    auto prefix_len = strlen(response_prefix);
+    if (name.compare(0, prefix_len, response_prefix) == 0) name.erase(0, prefix_len);
+    std::lock_guard<std::mutex> guard(mut);
+    auto it = mapped.find(name);
+    if (it == mapped.end()) {
+      int fd = open_segment(name);
+      if (fd < 0) return nullptr;
+      void *base = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if (base == MAP_FAILED) return nullptr;
+      it = mapped.emplace(name, (char *) base).first;
+    }
+    return it->second + offset;
+  }
+}
+
+#endif //BEETHOVENRUNTIME_SHM_ARENA_H
@@ -0,0 +1,52 @@
+#ifndef BEETHOVENRUNTIME_SHM_FUTEX_H
+#define BEETHOVENRUNTIME_SHM_FUTEX_H
+
+#include <atomic>
+#include <cinttypes>
+#include <ctime>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <chrono>
+#include <thread>
+#endif
+
+/**
+ * Sleep/wake on a 32-bit word that lives in a shared memory segment, so that it works across processes. On Linux this
+ * is a (non-private) futex. Elsewhere, waiting degrades to a short sleep and waking is a no-op, which is correct but
+ * slower.
+ */
+namespace shm_futex {
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free,
+                "futex words must be plain lock-free 32-bit words");
+
+  // Sleep as long as `*word == expected`, for at most `timeout_us` microseconds (0 means forever). Can wake up
+  // spuriously, so callers always re-check their condition
+  inline void wait(std::atomic<uint32_t> *word, uint32_t expected, uint64_t timeout_us = 0) {
+#ifdef __linux__
+    timespec ts{};
+    if (timeout_us) {
+      ts.tv_sec = time_t(timeout_us / 1000000);
+      ts.tv_nsec = long(timeout_us % 1000000) * 1000;
+    }
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, expected, timeout_us ? &ts : nullptr,
+            nullptr, 0);
+#else
+    if (word->load() == expected) std::this_thread::sleep_for(std::chrono::microseconds(timeout_us ? timeout_us : 50));
+#endif
+  }
+
+  inline void wake(std::atomic<uint32_t> *word, int n_waiters = 1) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, n_waiters, nullptr, nullptr, 0);
+#else
+    (void) word;
+    (void) n_waiters;
+#endif
+  }
+}
+
+#endif //BEETHOVENRUNTIME_SHM_FUTEX_H
@@ -6,6 +6,7 @@
 #define BEETHOVENRUNTIME_STATE_MACHINE_H
 
 
+#include <atomic>
 #include <cinttypes>
 #include <pthread.h>
 #include <map>
@@ -14,14 +15,15 @@
 #include "cmd_server.h"
 #include "sim/DataWrapper.h"
 #include "sim/mem_ctrl.h"
+#include "sim/profiler.h"
+#include "sim/cmd_report.h"
 #include "util.h"
 
 extern pthread_mutex_t cmdserverlock;
 extern std::queue<beethoven::rocc_cmd> cmds;
-extern std::unordered_map<system_core_pair, std::queue<int> *> in_flight;
 extern pthread_mutex_t main_lock;
 extern uint64_t memory_transacted;
-extern bool kill_sig;
+extern std::atomic<bool> kill_sig;
 extern uint64_t main_time;
 extern int cmds_inflight;
 #if NUM_DDR_CHANNELS >= 1
@@ -29,14 +31,27 @@ extern mem_intf_t axi4_mems[NUM_DDR_CHANNELS];
 #endif
 static int cmd_ctr = 0;
 
+// Most AXI-lite writes that the command path keeps in flight at once (AW or W issued, B not yet seen)
+#ifndef AXIL_MAX_OUTSTANDING_WRITES
+#define AXIL_MAX_OUTSTANDING_WRITES 4
+#endif
+static_assert(AXIL_MAX_OUTSTANDING_WRITES >= 1, "need at least one outstanding write");
+
+// With a response-valid probe: how many cycles the probe may stay high after a RESP_READY before we stop waiting for it
+// to drop and read RESP_VALID over the bus instead. Only a latency knob, see AXIControlIntf::resp_probe_stale
+#ifndef RESP_PROBE_SETTLE_CYCLES
+#define RESP_PROBE_SETTLE_CYCLES 4
+#endif
+
+// If the hardware guarantees that, once CMD_READY is high, it can absorb CMD_CREDITS command words back-to-back, then
+// we only need to read CMD_READY once per CMD_CREDITS words instead of once per word
+#ifdef CMD_CREDITS
+static_assert(CMD_CREDITS >= 1, "CMD_CREDITS must be at least one word");
+#endif
+
 enum cmd_transfer_state {
   CMD_INACTIVE,
-  CMD_BITS_WRITE_ADDR,
-  CMD_BITS_WRITE_DAT,
-  CMD_BITS_WRITE_B,
-  CMD_VALID_ADDR,
-  CMD_VALID_DAT,
-  CMD_VALID_WRITE_B,
+  CMD_WRITE,
   CMD_RECHECK_READY_ADDR,
   CMD_RECHECK_READY_DAT,
 };
@@ -70,6 +85,32 @@ struct command_transaction {
   bool ready_for_command = false;
 
   static const int payload_length = 5;
+#ifdef CMD_CREDITS
+  static const int words_per_check = CMD_CREDITS;
+#else
+  static const int words_per_check = 1;
+#endif
+
+  // Every command word is two writes: the word itself to CMD_BITS and then a 1 to CMD_VALID. Writes are numbered
+  // 2 * word (+1 for CMD_VALID). The AW and W channels advance independently through [0, burst_end) and are only held
+  // back by the number of writes that haven't been acknowledged yet.
+  uint8_t burst_end = 0;
+  uint8_t aw_issued = 0;
+  uint8_t w_issued = 0;
+  uint8_t b_received = 0;
+
+  void start_burst() {
+    int words = payload_length - progress;
+    if (words > words_per_check) words = words_per_check;
+    aw_issued = w_issued = b_received = 2 * progress;
+    burst_end = 2 * (progress + words);
+  }
+
+  static bool is_valid_write(int write) { return write & 1; }
+
+  [[nodiscard]] uint32_t write_data(int write) const {
+    return is_valid_write(write) ? 1 : cmdbuf[write / 2];
+  }
 };
 
 struct response_transaction {
@@ -117,6 +158,17 @@ struct AXIControlIntf : public ControlIntf {
     b_valid = valid;
   }
 
+  // Direct view of the design's response-valid signal (the one that RESP_VALID reads back). With it, a response is
+  // picked up as soon as it shows up instead of on the next RESP_VALID poll, and the bus isn't spent polling. Leave it
+  // unset (or build with FRONT_BUS_POLL_RESPONSES) to keep the FPGA-like polling.
+  byte_t resp_valid_probe;
+  bool has_resp_valid_probe = false;
+
+  void set_resp_valid_probe(byte_t probe) {
+    resp_valid_probe = probe;
+    has_resp_valid_probe = true;
+  }
+
   void tick() override {
     aw_valid.set(0);
     w_valid.set(0);
@@ -131,6 +183,20 @@ struct AXIControlIntf : public ControlIntf {
 
   const int check_freq = 50;
   int check_freq_ctr = 0;
+  // After we write RESP_READY, the design may take a few cycles to retire the word, and until then the probe still
+  // shows it. So after every RESP_READY the probe is stale until it's been seen low. If it stays high for
+  // RESP_PROBE_SETTLE_CYCLES (the next word may be right behind the old one), we ask the bus for RESP_VALID, exactly
+  // like without the probe. How long the design takes only affects how soon we see the next word, never which one
+  bool resp_probe_stale = false;
+  int resp_probe_stale_cycles = 0;
+
+  [[nodiscard]] bool resp_probe_settled() const {
+    return resp_probe_stale_cycles >= RESP_PROBE_SETTLE_CYCLES;
+  }
+
+  bool response_waiting() {
+    return has_resp_valid_probe && cmds_inflight > 0 && !resp_probe_stale && resp_valid_probe.get(0);
+  }
 
   command_transaction ongoing_cmd;
   response_transaction ongoing_rsp;
@@ -140,68 +206,50 @@ struct AXIControlIntf : public ControlIntf {
   
   void update_command_state() {
     switch (ongoing_cmd.state) {
-      // tell the beethoven that we're going to send 32-bits of a command over the PCIE bus
-      case CMD_BITS_WRITE_ADDR:
+      // Send the command words of this burst. For each word, write it to CMD_BITS and then "simulate" the decoupled
+      // interface by writing a 1 to CMD_VALID. AW and W go out as fast as the bus takes them, so several writes can be
+      // in flight at once, and we only wait for the B responses at the end of the burst.
+      case CMD_WRITE: {
         ongoing_cmd.ready_for_command = false;
-        aw_valid.set(1);
-        aw_addr.set(CMD_BITS);
-        if (aw_ready.get(0)) {
-          ongoing_cmd.state = CMD_BITS_WRITE_DAT;
-          //          printf("to write dat\n");
+        if (ongoing_cmd.aw_issued < ongoing_cmd.burst_end &&
+            ongoing_cmd.aw_issued - ongoing_cmd.b_received < AXIL_MAX_OUTSTANDING_WRITES) {
+          aw_valid.set(1);
+          aw_addr.set(command_transaction::is_valid_write(ongoing_cmd.aw_issued) ? CMD_VALID : CMD_BITS);
+          if (aw_ready.get(0)) ongoing_cmd.aw_issued++;
         }
-        break;
-        // send the command over the PCIE bus
-      case CMD_BITS_WRITE_DAT:
-        w_valid.set(1);
-        w_data.set(ongoing_cmd.cmdbuf[ongoing_cmd.progress]);
-        if (w_ready.get(0)) {
-          ongoing_cmd.state = CMD_BITS_WRITE_B;
+        if (ongoing_cmd.w_issued < ongoing_cmd.burst_end &&
+            ongoing_cmd.w_issued - ongoing_cmd.b_received < AXIL_MAX_OUTSTANDING_WRITES) {
+          w_valid.set(1);
+          w_data.set(ongoing_cmd.write_data(ongoing_cmd.w_issued));
+          if (w_ready.get(0)) ongoing_cmd.w_issued++;
         }
-        break;
-      case CMD_BITS_WRITE_B:
         b_ready.set(1);
-        if (b_valid.get(0)) {
-          ongoing_cmd.state = CMD_VALID_ADDR;
-        }
-        break;
-        // We just send the 32-bits, now "simulate" the decoupled interface by toggling to the CMD_VALID bit to 1
-        // This bit is visible from the CMD_VALID bit, so we need to perform an AXI transaction
-      case CMD_VALID_ADDR:
-        aw_valid.set(1);
-        aw_addr.set(CMD_VALID);
-        if (aw_ready.get(0)) {
-          ongoing_cmd.state = CMD_VALID_DAT;
-        }
-        break;
-        // send the CMD_VALID bit
-      case CMD_VALID_DAT:
-        w_valid.set(1);
-        w_data.set(1);
-        if (w_ready.get(0)) {
-          ongoing_cmd.state = CMD_VALID_WRITE_B;
-        }
-        break;
-      case CMD_VALID_WRITE_B:
-        b_ready.set(1);
-        if (b_valid.get(0)) {
-          ongoing_cmd.progress++;
-          // send last thing, yield bus
-          if (ongoing_cmd.progress == command_transaction::payload_length) {
-#if NUM_DDR_CHANNELS >= 1
-            for (auto &axi_mem: axi4_mems) {
-              axi_mem.mem_sys->ResetStats();
-              time_last_command = main_time;
-              memory_transacted = 0;
-            }
-#endif
+        if (b_valid.get(0)) ongoing_cmd.b_received++;
+        if (ongoing_cmd.b_received < ongoing_cmd.burst_end) break;
+
+        ongoing_cmd.progress = int8_t(ongoing_cmd.burst_end / 2);
+        // send last thing, yield bus
+        if (ongoing_cmd.progress == command_transaction::payload_length) {
+          // restart the progress display's rate. DRAMsim3's own stats keep running so that commands that overlap this
+          // one still get their numbers; per-command traffic is in the command report
+          time_last_command = main_time;
+          memory_transacted = 0;
+          // if there's another command waiting, ask for CMD_READY right away instead of waiting for the next poll
+          profiler::lock(&cmdserverlock);
+          bool more_commands = not cmds.empty();
+          pthread_mutex_unlock(&cmdserverlock);
+          if (more_commands) {
+            ongoing_cmd.state = CMD_RECHECK_READY_ADDR;
+          } else {
             ongoing_cmd.state = CMD_INACTIVE;
             bus_occupied = false;
-          } else {
-            // else, need to send the next 32-bit chunk and see that the channel is "ready"
-            ongoing_cmd.state = CMD_RECHECK_READY_ADDR;
           }
+        } else {
+          // else, need to send the next chunk and see that the channel is "ready"
+          ongoing_cmd.state = CMD_RECHECK_READY_ADDR;
         }
         break;
+      }
         // We just send 32-bits over the interface, check if it's ready for another 32b by requesting ready from the
         // CMD_READY bit
       case CMD_RECHECK_READY_ADDR:
@@ -215,9 +263,16 @@ struct AXIControlIntf : public ControlIntf {
       case CMD_RECHECK_READY_DAT:
         r_ready.set(1);
         if (r_valid.get(0)) {
-          // if it's ready for another command
-          if (r_data.get(0)) {
-            ongoing_cmd.state = CMD_BITS_WRITE_ADDR;
+          if (ongoing_cmd.progress == command_transaction::payload_length) {
+            // between two commands: hand the bus back (so responses still get a turn) and let CMD_INACTIVE start the
+            // next one
+            ongoing_cmd.ready_for_command = r_data.get(0);
+            ongoing_cmd.state = CMD_INACTIVE;
+            bus_occupied = false;
+          } else if (r_data.get(0)) {
+            // if it's ready for another command
+            ongoing_cmd.start_burst();
+            ongoing_cmd.state = CMD_WRITE;
           } else {
             ongoing_cmd.state = CMD_RECHECK_READY_ADDR;
           }
@@ -226,19 +281,25 @@ struct AXIControlIntf : public ControlIntf {
       case CMD_INACTIVE:
         if (ongoing_cmd.ready_for_command &&
             !bus_occupied &&
+            !response_waiting() &&
             (ongoing_update == UPDATE_IDLE_CMD || ongoing_update == UPDATE_IDLE_RESP)) {
-          pthread_mutex_lock(&cmdserverlock);
+          profiler::lock(&cmdserverlock);
           if (not cmds.empty()) {
             printf("enqueueing command: %d\n", cmd_ctr++);
             bus_occupied = true;
-            ongoing_cmd.state = CMD_BITS_WRITE_ADDR;
+            ongoing_cmd.state = CMD_WRITE;
             if (cmds.front().getXd()) {
               auto id = std::tuple<int, int>(cmds.front().getSystemId(), cmds.front().getCoreId());
               start_times[id] = main_time;
+              if (cmd_report::enabled) {
+                cmd_report::command_issued(cmds.front().getSystemId(), cmds.front().getCoreId(),
+                                           cmds.front().getOpcode());
+              }
             }
             cmds.front().pack(pack_cfg, ongoing_cmd.cmdbuf);
             kill_sig = cmds.front().getOpcode() == ROCC_OP_FLUSH;
             ongoing_cmd.progress = 0;
+            ongoing_cmd.start_burst();
             if (cmds.front().getXd() == 1)
               cmds_inflight++;
             cmds.pop();
@@ -290,11 +351,14 @@ struct AXIControlIntf : public ControlIntf {
       case RESPT_READY_WRITE_B:
         b_ready.set(1);
         if (b_valid.get(0)) {
+          resp_probe_stale = has_resp_valid_probe;
+          resp_probe_stale_cycles = 0;
           if (ongoing_rsp.progress == response_transaction::payload_length) {
             beethoven::rocc_response r(ongoing_rsp.resbuf, pack_cfg);
             auto id = std::tuple<int, int>(r.system_id, r.core_id);
             auto start = start_times[id];
             LOG(printf("Command took %f ms\n", float((main_time - start)) / 1000 / 1000 / 1000));
+            if (cmd_report::enabled) cmd_report::command_completed(r.system_id, r.core_id);
             register_reponse(ongoing_rsp.resbuf);
             cmds_inflight--;
             bus_occupied = false;
@@ -308,6 +372,15 @@ struct AXIControlIntf : public ControlIntf {
         }
         break;
       case RESPT_RECHECK_VALID_ADDR:
+        if (has_resp_valid_probe) {
+          // no need to ask the bus, just wait for the next word to show up
+          if (!resp_probe_stale && resp_valid_probe.get(0)) {
+            ongoing_rsp.state = RESPT_BITS_ADDR;
+            break;
+          }
+          // unless the probe never dropped
+          if (!resp_probe_stale || !resp_probe_settled()) break;
+        }
         ar_valid.set(1);
         ar_addr.set(RESP_VALID);
         if (ar_ready.get(0)) {
@@ -317,6 +390,8 @@ struct AXIControlIntf : public ControlIntf {
       case RESPT_RECHECK_VALID_READ:
         r_ready.set(1);
         if (r_valid.get(0)) {
+          // the bus has the final say on whether the acknowledged word is gone
+          resp_probe_stale = false;
           if (r_data.get(0)) {
             ongoing_rsp.state = RESPT_BITS_ADDR;
           } else {
@@ -329,9 +404,33 @@ struct AXIControlIntf : public ControlIntf {
   }
 
   void update_update_state() {
+    if (resp_probe_stale) {
+      if (!resp_valid_probe.get(0)) resp_probe_stale = false;
+      else resp_probe_stale_cycles++;
+    }
+    // with the probe, start reading a response the cycle it appears, whatever we were about to poll next
+    if (!bus_occupied && ongoing_rsp.state == RESPT_INACTIVE &&
+        (ongoing_update == UPDATE_IDLE_CMD || ongoing_update == UPDATE_IDLE_RESP) && response_waiting()) {
+      LOG(printf("Found valid response on cycle %lu!!!\n", main_time));
+      bus_occupied = true;
+      ongoing_rsp.progress = 0;
+      ongoing_rsp.state = RESPT_BITS_ADDR;
+      return;
+    }
+    // the probe stayed high since the last response. Whether that's the next one is up to the bus
+    if (!bus_occupied && ongoing_rsp.state == RESPT_INACTIVE &&
+        (ongoing_update == UPDATE_IDLE_CMD || ongoing_update == UPDATE_IDLE_RESP) && cmds_inflight > 0 &&
+        resp_probe_stale && resp_probe_settled()) {
+      bus_occupied = true;
+      ongoing_update = UPDATE_RESP_ADDR;
+      return;
+    }
     switch (ongoing_update) {
       case UPDATE_IDLE_RESP:
-        if (!bus_occupied && check_freq_ctr > check_freq) {
+        if (has_resp_valid_probe) {
+          // nothing to poll for
+          ongoing_update = UPDATE_IDLE_CMD;
+        } else if (!bus_occupied && check_freq_ctr > check_freq) {
           check_freq_ctr = 0;
           bus_occupied = true;
           ongoing_update = UPDATE_RESP_ADDR;
@@ -349,6 +448,7 @@ struct AXIControlIntf : public ControlIntf {
       case UPDATE_RESP_WAIT:
         r_ready.set(1);
         if (r_valid.get(0)) {
+          resp_probe_stale = false;
           ongoing_rsp.progress = 0;
           if (r_data.get(0)) {
             LOG(printf("Found valid response on cycle %lu!!!\n", main_time));
@@ -0,0 +1,51 @@
+#ifndef BEETHOVENRUNTIME_CLOCK_SCHEDULER_H
+#define BEETHOVENRUNTIME_CLOCK_SCHEDULER_H
+
+#include <cinttypes>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * Event scheduler for a handful of independent clock domains. Every domain is described by an integer frequency in
+ * kHz, so rising edge `n` of a domain happens at exactly n / f. Edges of different domains are ordered by comparing
+ * these fractions with integer cross-multiplication, so there is no per-cycle floating point math and no drift, no
+ * matter how long the simulation runs.
+ */
+struct clock_domain {
+  std::string name;
+  uint64_t freq_khz;
+  // number of rising edges that have happened so far
+  uint64_t edges = 0;
+  std::function<void()> on_edge;
+
+  // time of rising edge `n` in picoseconds, rounded down
+  [[nodiscard]] uint64_t edge_time_ps(uint64_t n) const {
+    return uint64_t((unsigned __int128) n * 1000000000ULL / freq_khz);
+  }
+
+  // time of the `h`-th half period (alternating rising and falling edges) in picoseconds, rounded down
+  [[nodiscard]] uint64_t half_period_time_ps(uint64_t h) const {
+    return uint64_t((unsigned __int128) h * 1000000000ULL / (2 * freq_khz));
+  }
+};
+
+struct clock_scheduler {
+  std::vector<clock_domain> domains;
+
+  int add_domain(const std::string &name, uint64_t freq_khz, std::function<void()> on_edge = {});
+
+  void clear() { domains.clear(); }
+
+  // Fire, in time order, every edge of every other domain that happens at or before the next rising edge of `master`,
+  // then advance `master` by one edge. The master's own handler is not called: whoever drives the master clock is
+  // responsible for what happens on its edges.
+  void run_until_next_edge(int master);
+
+  static uint64_t khz_from_period_ns(double period_ns);
+};
+
+extern clock_scheduler sim_clocks;
+extern int fpga_clock_domain;
+
+#endif //BEETHOVENRUNTIME_CLOCK_SCHEDULER_H
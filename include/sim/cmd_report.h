@@ -0,0 +1,45 @@
+#ifndef BEETHOVENRUNTIME_CMD_REPORT_H
+#define BEETHOVENRUNTIME_CMD_REPORT_H
+
+#include <cinttypes>
+#include <string>
+
+/**
+ * Per-command report. Every command that expects a response produces one record when that response comes back:
+ * opcode, system/core, the accelerator cycles it was issued and completed on, and the memory traffic attributed to
+ * it. The design doesn't tell us which command a memory transaction belongs to, so traffic is split evenly between
+ * all of the commands that are in flight when it happens. A command that ran alone gets exactly the traffic of its
+ * window, and overlapping commands share it instead of each being charged for all of it. `max_concurrent` says how
+ * many commands it had to share with.
+ *
+ * Row hits are estimated from the order that the front end hands requests to the memory model. Each DRAM bank
+ * remembers the last row that was accessed in it, and an access to that same row is counted as a hit. This ignores
+ * reordering by the DRAMsim3 scheduler and refresh.
+ *
+ * Records go to a CSV file, or to JSON (one object per line) if the file name ends in .json or .jsonl. Enable with
+ * `-cmdreport <file>` on the Verilator binary or BEETHOVEN_CMD_REPORT=<file> for VPI simulators.
+ */
+namespace cmd_report {
+  extern bool enabled;
+
+  void open(const std::string &path);
+
+  // Sweep children write their own report, with `suffix` added to the file name (before the extension)
+  void reopen(const std::string &suffix);
+
+  void flush();
+
+  void command_issued(int system_id, int core_id, int opcode);
+
+  void command_completed(int system_id, int core_id);
+
+  // data moved over the memory channels' R and W buses
+  void count_read(uint64_t bytes);
+
+  void count_write(uint64_t bytes);
+
+  // a request of `bytes` starting at `fpga_addr` was handed to the memory model of DRAM channel `channel`
+  void count_dram_access(int channel, uint64_t fpga_addr, uint64_t bytes);
+}
+
+#endif //BEETHOVENRUNTIME_CMD_REPORT_H
@@ -22,9 +22,10 @@
 extern uint64_t main_time;
 
 #include "sim/axi/vpi_handle.h"
+#include "sim/profiler.h"
 
-#define RLOCK pthread_mutex_lock(&axi4_mem.read_queue_lock);
-#define WLOCK pthread_mutex_lock(&axi4_mem.write_queue_lock);
+#define RLOCK profiler::lock(&axi4_mem.read_queue_lock);
+#define WLOCK profiler::lock(&axi4_mem.write_queue_lock);
 #define RUNLOCK pthread_mutex_unlock(&axi4_mem.read_queue_lock);
 #define WUNLOCK pthread_mutex_unlock(&axi4_mem.write_queue_lock);
 
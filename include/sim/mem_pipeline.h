@@ -0,0 +1,41 @@
+#ifndef BEETHOVENRUNTIME_MEM_PIPELINE_H
+#define BEETHOVENRUNTIME_MEM_PIPELINE_H
+
+#include <cinttypes>
+
+/**
+ * Optional pipelined memory model. The DRAM work of an accelerator cycle (DRAMsim3 ticks, issuing queued
+ * transactions and the completion callbacks that they trigger) only feeds back into the RTL through the AXI channels,
+ * so it doesn't have to finish before the model is evaluated again. In pipelined mode, tick_signals() only counts the
+ * DRAM edges of cycle t and hands them to a helper thread, which runs them while the simulation thread evaluates the
+ * design. The simulation thread waits for that work right before it services the AXI channels of cycle t+1, so the
+ * memory model runs exactly one cycle behind and results stay deterministic.
+ *
+ * Enable with `-pipeline_mem 1` on the Verilator binary or BEETHOVEN_PIPELINE_MEM=1 for VPI simulators.
+ *
+ * While it's enabled, the helper may be inside the DRAM models at any point between post() and drain(). Anything else
+ * that touches an axi4_mems[i].mem_sys (stats, resets, ...) has to drain() first, or stop() if it can't be sure that
+ * the simulation thread is in a state to drain.
+ */
+namespace mem_pipeline {
+  extern bool enabled;
+
+  // Turn on pipelined mode and start the helper thread. Call from the simulation thread (the helper inherits its core
+  // affinity) after the DRAM models have been built. Also used to restart the helper after a fork
+  void start();
+
+  // count one edge of DRAM channel `channel` for the current cycle
+  void count_ddr_edge(int channel);
+
+  // hand the edges counted for the current cycle to the helper thread
+  void post();
+
+  // block until the helper thread has finished everything that was posted
+  void drain();
+
+  // Stop the helper thread and go back to running the memory model inline. The helper finishes the cycle it's on, and
+  // cycles it hasn't picked up yet are dropped. Safe to call from a signal handler on any thread but the helper's
+  void stop();
+}
+
+#endif //BEETHOVENRUNTIME_MEM_PIPELINE_H
@@ -0,0 +1,87 @@
+#ifndef BEETHOVENRUNTIME_PROFILER_H
+#define BEETHOVENRUNTIME_PROFILER_H
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Low-overhead breakdown of where simulator wall-clock time goes. Only one cycle out of every `sample_period` is
+ * timed, so the cost of reading the timestamp counter is paid rarely and un-sampled cycles only pay for a branch.
+ * A report (simulated kHz and the per-phase share of the sampled cycles) is printed every few seconds and at exit.
+ * Whatever isn't covered by a top-level phase is reported as "other", which under VPI is the simulator itself.
+ *
+ * Enable with `-profile <period>` on the Verilator binary or BEETHOVEN_SIM_PROFILE=<period> for VPI simulators.
+ */
+enum sim_phase {
+  PHASE_EVAL_POSEDGE,
+  PHASE_EVAL_NEGEDGE,
+  PHASE_TRACE_DUMP,
+  PHASE_TICK_SIGNALS,
+  // sub-phases of tick_signals
+  PHASE_FRONT_BUS,
+  PHASE_DRAM_TICK,
+  PHASE_AXI_CHANNELS,
+  PHASE_LOCK_WAIT,
+  // waiting for the memory model helper thread (pipelined memory mode)
+  PHASE_MEM_PIPELINE_WAIT,
+  N_SIM_PHASES
+};
+
+namespace profiler {
+  extern bool enabled;
+  // true while the calling thread is inside of a sampled cycle
+  extern thread_local bool sampling;
+
+  void configure(uint64_t sample_period);
+
+  // mark the start of a simulated cycle. Cheap unless this cycle is sampled or a report is due
+  void begin_cycle(uint64_t cycle);
+
+  void record(sim_phase phase, uint64_t ticks);
+
+  void report(FILE *f, bool final);
+
+  inline uint64_t timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  struct phase_timer {
+    sim_phase phase;
+    uint64_t start = 0;
+
+    explicit phase_timer(sim_phase phase) : phase(phase) {
+      if (sampling) start = timestamp();
+    }
+
+    ~phase_timer() {
+      if (sampling) record(phase, timestamp() - start);
+    }
+  };
+
+  inline void lock(pthread_mutex_t *m) {
+    if (sampling) {
+      auto start = timestamp();
+      pthread_mutex_lock(m);
+      record(PHASE_LOCK_WAIT, timestamp() - start);
+    } else {
+      pthread_mutex_lock(m);
+    }
+  }
+}
+
+#endif //BEETHOVENRUNTIME_PROFILER_H
@@ -0,0 +1,28 @@
+#ifndef BEETHOVENRUNTIME_SWEEP_H
+#define BEETHOVENRUNTIME_SWEEP_H
+
+#include <cinttypes>
+#include <string>
+
+/**
+ * Snapshot fan-out for design-space sweeps. After a warm-up prefix has been simulated, the simulator forks itself
+ * once per line of a sweep file. Every child starts from the same in-memory state and serves its own cmd/data server
+ * files (the usual names suffixed with `_sweep<k>`), so each one can be driven by a different command stream. A line
+ * may name a DRAMsim3 ini file, in which case that child swaps in the new memory model before continuing. Empty lines
+ * or `-` keep the current memory model.
+ *
+ * Every child copies the allocations' backing stores into segments of its own, named after the originals with the
+ * same `_sweep<k>` suffix, and maps those shared. So the parent (which only waits on its children after the fork) stays
+ * a pristine snapshot, siblings never observe each other's writes, and a child's clients see what its accelerator
+ * writes once they map the suffixed names. Each child lists them in allocations_sweep<k>.txt, one allocation per line:
+ * device address (hex), size, segment name, offset in the segment and segment size.
+ */
+namespace sweep {
+  void configure(const std::string &sweep_file, uint64_t fork_after_cycle);
+
+  // Called once per simulated cycle. Forks once the warm-up is over and the runtime is quiescent. Returns only in
+  // the children; the parent waits on them and exits.
+  void maybe_fork(uint64_t cycle);
+}
+
+#endif //BEETHOVENRUNTIME_SWEEP_H
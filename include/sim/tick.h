@@ -9,6 +9,12 @@ struct ControlIntf {
   virtual void tick() = 0;
 };
 
+#include <cinttypes>
+
+// (Re)build the clock domains that tick_signals() drives: the accelerator clock, one domain per DRAM channel and, if
+// CONTROL_CLOCK_MHZ is defined, a separate clock for the control bus. Must be called after mem_ctrl::init()
+void init_clocks(uint64_t fpga_clock_mhz);
+
 void tick_signals(ControlIntf *ctrl);
 
 #endif //BEETHOVENRUNTIME_TICK_H
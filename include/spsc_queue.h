@@ -0,0 +1,58 @@
+#ifndef BEETHOVENRUNTIME_SPSC_QUEUE_H
+#define BEETHOVENRUNTIME_SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * Bounded, lock-free queue for exactly one producer thread and one consumer thread. `N` must be a power of two.
+ * The producer only writes `tail` and the consumer only writes `head`, so each side keeps a cached copy of the other
+ * side's index and only touches the shared cache line when the cached copy says the queue looks full/empty.
+ */
+template<typename T, size_t N>
+struct spsc_queue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "spsc_queue size must be a power of two");
+
+  bool try_push(const T &item) {
+    auto t = tail.load(std::memory_order_relaxed);
+    if (t - head_cache == N) {
+      head_cache = head.load(std::memory_order_acquire);
+      if (t - head_cache == N) return false;
+    }
+    slots[t & (N - 1)] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_pop(T &item) {
+    auto h = head.load(std::memory_order_relaxed);
+    if (h == tail_cache) {
+      tail_cache = tail.load(std::memory_order_acquire);
+      if (h == tail_cache) return false;
+    }
+    item = slots[h & (N - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // only exact when called from one of the two sides while the other side is idle
+  [[nodiscard]] bool empty() const {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+
+  // only safe to call while neither side is using the queue
+  void reset() {
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    head_cache = tail_cache = 0;
+  }
+
+private:
+  T slots[N];
+  alignas(64) std::atomic<size_t> head{0};
+  size_t tail_cache = 0;
+  alignas(64) std::atomic<size_t> tail{0};
+  size_t head_cache = 0;
+};
+
+#endif //BEETHOVENRUNTIME_SPSC_QUEUE_H
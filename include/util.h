@@ -5,6 +5,8 @@
 #ifndef BEETHOVENRUNTIME_UTIL_H
 #define BEETHOVENRUNTIME_UTIL_H
 
+#include <string>
+
 constexpr int roundUp(float q) {
   float d = q - (int) q;
   if (q < 0) {
@@ -15,6 +17,10 @@ constexpr int roundUp(float q) {
 }
 
 
+// Appended to the names of the shared-memory files this process serves. Empty, except inside the children of a
+// snapshot sweep (see sim/sweep.h), which each need their own cmd/data server files.
+extern std::string shm_instance_suffix;
+
 // if we're not running in verbose mode, just turn the print into a string and forget about it...
 #ifndef VERBOSE
 #define LOG(x) (#x)
@@ -0,0 +1,30 @@
+#ifndef BEETHOVENRUNTIME_XDMA_POOL_H
+#define BEETHOVENRUNTIME_XDMA_POOL_H
+
+#include <cinttypes>
+#include <cstddef>
+
+/**
+ * Host <-> FPGA transfers spread over every XDMA channel that fpga_setup() opened. A single fpga_dma_burst_* call keeps
+ * one DMA engine busy and leaves the rest of the link idle, so transfers larger than a chunk (BEETHOVEN_XDMA_CHUNK_KB,
+ * default 1024) are cut into chunks that one thread per channel works through in parallel. Transfers from several
+ * callers share the channel threads and finish in the order they were submitted.
+ *
+ * fill() and copy() work on device memory only. The XDMA shell has no card-to-card engine, so fill() writes every chunk
+ * from the same host-side chunk of the pattern, and copy() has each channel read a chunk back into a bounce buffer and
+ * write it out again. Neither touches more than a chunk of host memory per channel, whatever the size. The source and
+ * destination of a copy must not overlap.
+ *
+ * All calls block until the whole transfer is done and return 0, or the first non-zero return code of any chunk.
+ */
+namespace xdma_pool {
+  int write(uint8_t *buffer, size_t xfer_sz, uint64_t fpga_addr);
+
+  int read(uint8_t *buffer, size_t xfer_sz, uint64_t fpga_addr);
+
+  int fill(uint8_t value, size_t xfer_sz, uint64_t fpga_addr);
+
+  int copy(uint64_t dst_addr, uint64_t src_addr, size_t xfer_sz);
+}
+
+#endif //BEETHOVENRUNTIME_XDMA_POOL_H
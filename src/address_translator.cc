@@ -0,0 +1,120 @@
+#include "address_translator.h"
+#include <iostream>
+
+#if defined(SIM) && !defined(USE_VERILATOR)
+#include <vpi_user.h>
+#endif
+
+namespace {
+  // must match the shift in slot_for()
+  const int n_cache_slots = 64;
+
+  struct cache_entry {
+    const address_translator *owner;
+    uint64_t generation;
+    uint64_t fpga_addr;
+    uint64_t mapping_length;
+    char *cpu_addr;
+  };
+
+  thread_local cache_entry cache[n_cache_slots];
+
+  // allocations tend to be aligned alike, so hash the whole page number instead of taking its low bits, or
+  // concurrent streams at the same offset into different buffers would all fight over one slot
+  inline cache_entry &slot_for(uint64_t fp_addr) {
+    return cache[((fp_addr >> 12) * 0x9E3779B97F4A7C15ull) >> 58];
+  }
+}
+
+const address_translator::addr_pair *address_translator::find(uint64_t fp_addr) const {
+  // the last mapping that starts at or before fp_addr is the only one that can contain it
+  auto it = mappings.upper_bound(addr_pair(fp_addr, nullptr, 0));
+  if (it == mappings.begin()) return nullptr;
+  --it;
+  if (it->fpga_addr + it->mapping_length <= fp_addr) return nullptr;
+  return &*it;
+}
+
+void *address_translator::translate(uint64_t fp_addr) const {
+  auto gen = generation.load(std::memory_order_acquire);
+  auto &slot = slot_for(fp_addr);
+  if (slot.owner == this && slot.generation == gen &&
+      slot.fpga_addr <= fp_addr && fp_addr - slot.fpga_addr < slot.mapping_length) {
+    return slot.cpu_addr + (fp_addr - slot.fpga_addr);
+  }
+
+  pthread_rwlock_rdlock(&lock);
+  auto m = find(fp_addr);
+  if (m == nullptr) {
+    // the data server may change the mappings as soon as we let go of the lock
+    auto existing = mappings;
+    pthread_rwlock_unlock(&lock);
+    std::cerr << "BAD ADDRESS IN TRANSLATION FROM FPGA -> CPU: " << std::hex << fp_addr << ". You might be running outside of your allocated segment... " << std::endl;
+    std::cerr << "Existing Mappings:" << std::endl;
+    for (auto q: existing) {
+      std::cerr << q.fpga_addr << "\t" << q.mapping_length << std::endl;
+    }
+#if defined(SIM) && defined(TRACE)
+    tfp->close();
+#endif
+#if defined(SIM) && !defined(USE_VERILATOR)
+    vpi_control(vpiFinish);
+    return nullptr;
+#else
+    throw std::exception();
+#endif
+  }
+  // `gen` was read before we took the lock, so if the mappings changed in between, this entry is already stale and
+  // just won't be used
+  slot = {this, gen, m->fpga_addr, m->mapping_length, (char *) m->cpu_addr};
+  void *cpu_addr = (char *) m->cpu_addr + (fp_addr - m->fpga_addr);
+  pthread_rwlock_unlock(&lock);
+  return cpu_addr;
+}
+
+void *address_translator::translate_range(uint64_t fp_addr, uint64_t len) const {
+  pthread_rwlock_rdlock(&lock);
+  auto m = find(fp_addr);
+  void *cpu_addr = nullptr;
+  // written so that a huge `len` can't wrap around
+  if (m != nullptr && len <= m->mapping_length - (fp_addr - m->fpga_addr)) {
+    cpu_addr = (char *) m->cpu_addr + (fp_addr - m->fpga_addr);
+  }
+  pthread_rwlock_unlock(&lock);
+  return cpu_addr;
+}
+
+void address_translator::add_mapping(uint64_t fpga_addr, uint64_t mapping_length, void *cpu_addr) {
+  pthread_rwlock_wrlock(&lock);
+  mappings.emplace(fpga_addr, cpu_addr, mapping_length);
+  generation.fetch_add(1, std::memory_order_release);
+  pthread_rwlock_unlock(&lock);
+}
+
+void address_translator::remove_mapping(uint64_t fpga_addr) {
+  addr_pair a(fpga_addr, nullptr, 0);
+  pthread_rwlock_wrlock(&lock);
+  auto it = mappings.find(a);
+  if (it == mappings.end()) {
+    pthread_rwlock_unlock(&lock);
+    std::cerr << "ERROR - could not remove mapping in data server because could not find address...\n"
+              << std::endl;
+    throw std::exception();
+  }
+  mappings.erase(it);
+  generation.fetch_add(1, std::memory_order_release);
+  pthread_rwlock_unlock(&lock);
+}
+
+std::pair<void *, uint64_t> address_translator::get_mapping(uint64_t fpga_addr) const {
+  pthread_rwlock_rdlock(&lock);
+  auto it = mappings.find(addr_pair(fpga_addr, nullptr, 0));
+  if (it != mappings.end()) {
+    auto mapping = std::make_pair(it->cpu_addr, it->mapping_length);
+    pthread_rwlock_unlock(&lock);
+    return mapping;
+  }
+  pthread_rwlock_unlock(&lock);
+  std::cerr << "Mapping not found!" << std::endl;
+  throw std::exception();
+}
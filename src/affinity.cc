@@ -0,0 +1,110 @@
+#include "affinity.h"
+#include "util.h"
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+  // parse "0-3,8,10-11" into a cpu set. Returns false if the string is absent or empty
+  bool parse_cpu_list(const char *list, cpu_set_t &set) {
+    CPU_ZERO(&set);
+    if (list == nullptr) return false;
+    std::string s(list);
+    size_t pos = 0;
+    int count = 0;
+    while (pos < s.size()) {
+      size_t end = s.find(',', pos);
+      if (end == std::string::npos) end = s.size();
+      std::string item = s.substr(pos, end - pos);
+      size_t dash = item.find('-');
+      int lo = std::atoi(item.substr(0, dash).c_str());
+      int hi = dash == std::string::npos ? lo : std::atoi(item.substr(dash + 1).c_str());
+      for (int c = lo; c <= hi && c < CPU_SETSIZE; ++c) {
+        CPU_SET(c, &set);
+        count++;
+      }
+      pos = end + 1;
+    }
+    return count > 0;
+  }
+
+  bool model_cpus(cpu_set_t &set) {
+    if (parse_cpu_list(getenv("BEETHOVEN_MODEL_CPUS"), set)) return true;
+#ifdef VERILATOR_THREADS
+    CPU_ZERO(&set);
+    for (int c = 0; c < VERILATOR_THREADS; ++c) CPU_SET(c, &set);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  bool runtime_cpus(cpu_set_t &set) {
+    if (parse_cpu_list(getenv("BEETHOVEN_RUNTIME_CPUS"), set)) return true;
+    cpu_set_t model;
+    if (!model_cpus(model)) return false;
+    CPU_ZERO(&set);
+    int n_cpus = (int) std::thread::hardware_concurrency();
+    int count = 0;
+    for (int c = 0; c < n_cpus; ++c) {
+      if (!CPU_ISSET(c, &model)) {
+        CPU_SET(c, &set);
+        count++;
+      }
+    }
+    if (count == 0) {
+      std::cerr << "No cores left over for the runtime threads after pinning the model. Leaving them unpinned"
+                << std::endl;
+      return false;
+    }
+    return true;
+  }
+}
+
+void affinity::pin_model_threads() {
+  cpu_set_t set;
+  if (!model_cpus(set)) return;
+  DIR *tasks = opendir("/proc/self/task");
+  if (tasks == nullptr) {
+    std::cerr << "Could not list threads to pin: " << strerror(errno) << std::endl;
+    return;
+  }
+  int n_pinned = 0;
+  while (auto *ent = readdir(tasks)) {
+    if (ent->d_name[0] == '.') continue;
+    pid_t tid = std::atoi(ent->d_name);
+    if (sched_setaffinity(tid, sizeof(set), &set)) {
+      std::cerr << "Failed to pin thread " << tid << ": " << strerror(errno) << std::endl;
+    } else {
+      n_pinned++;
+    }
+  }
+  closedir(tasks);
+  std::cout << "Pinned " << n_pinned << " simulation threads" << std::endl;
+}
+
+void affinity::pin_runtime_thread() {
+  cpu_set_t set;
+  if (!runtime_cpus(set)) return;
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (rc) {
+    std::cerr << "Failed to pin runtime thread: " << strerror(rc) << std::endl;
+  }
+}
+
+#else
+
+void affinity::pin_model_threads() {}
+
+void affinity::pin_runtime_thread() {}
+
+#endif
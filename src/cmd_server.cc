@@ -10,15 +10,24 @@
 #include <beethoven_hardware.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <csignal>
 #include <cerrno>
 #include <cstdio>
 #include <cstring>
 #include <sys/mman.h>
 #include <tuple>
 #include <unistd.h>
+#include <unordered_map>
+#include <vector>
 
 #include "response_poller.h"
+#include "affinity.h"
+#include "cmd_ring.h"
+#include "latency_stats.h"
 
 // for shared memory
 #include "util.h"
@@ -35,35 +44,350 @@
 
 #endif
 #ifdef SIM
-extern "C" {
-extern bool kill_sig;
-};
+#include <atomic>
+extern std::atomic<bool> kill_sig;
 #endif
 
-system_core_pair::system_core_pair(int system, int core) {
-  this->system = system;
-  this->core = core;
+using namespace beethoven;
+
+std::string shm_instance_suffix;
+
+static std::string cmd_file_name() {
+  return cmd_server_file_name() + shm_instance_suffix;
 }
 
-using namespace beethoven;
+static std::string ring_file_name() {
+  return cmd_ring_file_name(shm_instance_suffix);
+}
 
 cmd_server_file *csf;
 
 pthread_mutex_t cmdserverlock = PTHREAD_MUTEX_INITIALIZER;
 std::queue<beethoven::rocc_cmd> cmds;
-std::unordered_map<system_core_pair, std::queue<int> *> in_flight;
+in_flight_table in_flight;
 
 constexpr int num_cmd_beats = (int) roundUp((float) (32 * 5) / AXIL_BUS_WIDTH);
 
+// Rings that commands come in on: the main ring at 0 and client channel k at k + 1. Only the ring server thread
+// changes this, and only with cmdserverlock held
+static cmd_ring_file *channels[cmd_ring_file::max_channels + 1];
+// completions owed to each channel. A closed channel is only torn down once this drops to zero
+static int channel_outstanding[cmd_ring_file::max_channels + 1];
+// which channel's completion queue the response for each handle goes to. -1 means unlocking the handle's mutex
+static int16_t response_channel[cmd_ring_file::n_response_handles];
+// set from delivering a handle's command until its response has been handed back
+static std::atomic<bool> handle_in_flight[cmd_ring_file::n_response_handles];
+// where each handle's last response went: the channel (-1 for none), which incarnation of it, and the position in its
+// completion queue. Written before handle_in_flight is cleared
+static struct {
+  int16_t channel = -1;
+  uint32_t epoch = 0;
+  uint64_t pos = 0;
+} completed_at[cmd_ring_file::n_response_handles];
+// bumped every time a channel is torn down, so that a completion queue position of its last client isn't mistaken for
+// one of the next. Only changed with cmdserverlock held
+static uint32_t channel_epoch[cmd_ring_file::max_channels + 1];
+
+// Hand `n` commands to the hardware (or to the simulator's queue), in order, and remember who to give their
+// responses to. On FPGA the whole batch goes over MMIO under one acquisition of the bus lock. `received` is when the
+// runtime got the batch (latency_stats::now_ns()).
+// Must be called with cmdserverlock held
+static void deliver_commands(beethoven::rocc_cmd *batch, const int *ids, int n, int cq_channel, uint64_t received) {
+  // let main thread know how to return result. This has to happen first, the response could show up right away
+  for (int c = 0; c < n; ++c) {
+    auto &cmd = batch[c];
+    if (!cmd.getXd()) continue;
+    assert(ids[c] != 0xffff);
+    latency_stats::command_received(ids[c], received);
+    response_channel[ids[c]] = int16_t(cq_channel);
+    if (cq_channel >= 0) channel_outstanding[cq_channel]++;
+    completed_at[ids[c]].channel = -1;
+    handle_in_flight[ids[c]].store(true, std::memory_order_relaxed);
+    // can't fail, every command in flight holds one of the handles that the table is sized for
+    bool tracked = in_flight.push(cmd.getSystemId(), cmd.getCoreId(), ids[c]);
+    assert(tracked);
+    (void) tracked;
+  }
+#if defined(FPGA) || defined(VSIM)
+#if AWS or defined(Kria)
+  // wake up response poller if this command expects a response
+  for (int c = 0; c < n; ++c) {
+    if (batch[c].getXd()) sem_post(&csf->processes_waiting);
+  }
+  auto bus_wait_start = latency_stats::now_ns();
+  pthread_mutex_lock(&bus_lock);
+  latency_stats::record(latency_stats::STAGE_BUS_LOCK_WAIT, latency_stats::now_ns() - bus_wait_start);
+#endif
+  for (int c = 0; c < n; ++c) {
+    auto push_start = latency_stats::now_ns();
+    uint32_t pack[5];
+    batch[c].pack(pack_cfg, pack);
+    //    if (sizeof(pack[0]) > 64) {
+    //      printf("FAILURE - cannot use peek-poke give the current ");
+    //      exit(1);
+    //    }
+    for (int i = 0; i < num_cmd_beats; ++i) {// command is 5 32-bit payloads
+      while (!peek_mmio(CMD_READY)) {}
+      poke_mmio(CMD_BITS, pack[i]);
+      poke_mmio(CMD_VALID, 1);
+    }
+    auto pushed = latency_stats::now_ns();
+    latency_stats::record(latency_stats::STAGE_MMIO_PUSH, pushed - push_start);
+    if (batch[c].getXd()) latency_stats::command_delivered(ids[c], pushed);
+  }
+#endif
+  LOG(std::cerr << "Successfully delivered " << n << " command(s)\n"
+                << std::endl);
+#if AWS or defined(Kria)
+  pthread_mutex_unlock(&bus_lock);
+#else
+  // sim only
+  for (int c = 0; c < n; ++c) {
+    cmds.push(batch[c]);
+    if (batch[c].getXd()) latency_stats::command_delivered(ids[c], latency_stats::now_ns());
+  }
+#endif
+}
+
+// spin this many times on empty rings before going to sleep on the doorbell
+static const int ring_spins_before_sleep = 2048;
+
+// how often the ring server looks for clients that died
+static const auto client_check_interval = std::chrono::milliseconds(100);
+
+static bool client_is_gone(int32_t pid) {
+  return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+// Put a handle that a client took through the ring helpers back on the free list on its behalf. Re-locks the handle's
+// mutex in case its response was handed back without the client ever picking it up.
+// Must be called with cmdserverlock held
+static void reclaim_handle(cmd_ring_file *main_ring, int id) {
+  pthread_mutex_lock(&csf->free_list_lock);
+  if (main_ring->handle_owner[id].load(std::memory_order_relaxed) != 0) {
+    main_ring->handle_owner[id].store(0, std::memory_order_relaxed);
+    pthread_mutex_trylock(&csf->wait_for_response[id]);
+    csf->free_list_idx++;
+    csf->free_list[csf->free_list_idx] = id;
+  }
+  pthread_mutex_unlock(&csf->free_list_lock);
+}
+
+// Map newly registered channels and tear down closed ones. Returns true if a closed channel is still waiting on
+// completions, in which case we have to look again later
+static bool update_channels(cmd_ring_file *main_ring) {
+  bool pending = false;
+  for (int k = 0; k < cmd_ring_file::max_channels; ++k) {
+    auto &entry = main_ring->channel_registry[k];
+    auto &ch = channels[k + 1];
+    auto state = entry.state.load();
+    if (state == cmd_ring_file::CHANNEL_ACTIVE && client_is_gone(entry.pid.load())) {
+      entry.state.store(state = cmd_ring_file::CHANNEL_CLOSING);
+    }
+    if (state == cmd_ring_file::CHANNEL_CLAIMED && client_is_gone(entry.pid.load())) {
+      // the client died while setting the channel up
+      shm_unlink(cmd_channel_file_name(k, shm_instance_suffix).c_str());
+      entry.pid.store(0);
+      entry.state.store(cmd_ring_file::CHANNEL_FREE);
+    } else if (state == cmd_ring_file::CHANNEL_ACTIVE && ch == nullptr) {
+      auto mapped = cmd_ring::map_ring(cmd_channel_file_name(k, shm_instance_suffix), O_RDWR);
+      if (mapped == nullptr) {
+        entry.pid.store(0);
+        entry.state.store(cmd_ring_file::CHANNEL_FREE);
+        continue;
+      }
+      pthread_mutex_lock(&cmdserverlock);
+      ch = mapped;
+      channel_outstanding[k + 1] = 0;
+      pthread_mutex_unlock(&cmdserverlock);
+      LOG(std::cerr << "Registered command channel " << k << " for pid " << entry.pid.load() << std::endl);
+    } else if (state == cmd_ring_file::CHANNEL_CLOSING) {
+      pthread_mutex_lock(&cmdserverlock);
+      // commands that are still queued get delivered first, so that their handles come back through the completion
+      // queue like everyone else's
+      if (channel_outstanding[k + 1] > 0 || (ch != nullptr && !ch->looks_empty())) {
+        pending = true;
+      } else {
+        if (ch != nullptr) {
+          // nobody is going to reap these anymore
+          cmd_ring_file::completion left[64];
+          int n;
+          while ((n = ch->poll_completions(left, 64)) > 0) {
+            for (int i = 0; i < n; ++i) reclaim_handle(main_ring, left[i].handle);
+          }
+          munmap(ch, sizeof(cmd_ring_file));
+        }
+        ch = nullptr;
+        channel_epoch[k + 1]++;
+        shm_unlink(cmd_channel_file_name(k, shm_instance_suffix).c_str());
+        entry.pid.store(0);
+        entry.state.store(cmd_ring_file::CHANNEL_FREE);
+      }
+      pthread_mutex_unlock(&cmdserverlock);
+    }
+  }
+  return pending;
+}
+
+// A handle whose owner died, waiting for everything the owner may have done with it to settle. Only used by the ring
+// server thread
+struct dead_handle {
+  int id;
+  int32_t pid;
+  // how far each ring had been filled when the owner was found dead. It can't have queued anything past that
+  uint64_t tail[cmd_ring_file::max_channels + 1];
+  uint32_t epoch[cmd_ring_file::max_channels + 1];
+};
+static std::vector<dead_handle> dead_handles;
+static bool dead_handle_pending[cmd_ring_file::n_response_handles];
+
+// Give the handles of clients that died back to the free list. A handle is only taken back once its command can't be
+// sitting in a ring anymore, its response isn't owed anymore, and it isn't waiting in a completion queue that a live
+// client may still reap (or that a channel teardown will reclaim)
+static void reclaim_dead_handles(cmd_ring_file *main_ring) {
+  std::unordered_map<int32_t, bool> gone;
+  for (int id = 0; id < int(cmd_ring_file::n_response_handles); ++id) {
+    auto pid = main_ring->handle_owner[id].load(std::memory_order_relaxed);
+    if (pid <= 0 || dead_handle_pending[id]) continue;
+    auto it = gone.find(pid);
+    if (it == gone.end()) it = gone.emplace(pid, client_is_gone(pid)).first;
+    if (!it->second) continue;
+    dead_handle d{id, pid, {}, {}};
+    for (int c = 0; c <= cmd_ring_file::max_channels; ++c) {
+      d.tail[c] = channels[c] ? channels[c]->tail.load() : 0;
+      d.epoch[c] = channel_epoch[c];
+    }
+    dead_handles.push_back(d);
+    dead_handle_pending[id] = true;
+  }
+  if (dead_handles.empty()) return;
+  pthread_mutex_lock(&cmdserverlock);
+  auto settled = [&](const dead_handle &d) {
+    // released by its owner before it died, or reclaimed with a channel
+    if (main_ring->handle_owner[d.id].load(std::memory_order_relaxed) != d.pid) return true;
+    if (handle_in_flight[d.id].load(std::memory_order_acquire)) return false;
+    for (int c = 0; c <= cmd_ring_file::max_channels; ++c) {
+      if (channels[c] != nullptr && channel_epoch[c] == d.epoch[c] && channels[c]->head.load() < d.tail[c]) {
+        return false;
+      }
+    }
+    auto &at = completed_at[d.id];
+    if (at.channel >= 0 && channels[at.channel] != nullptr && channel_epoch[at.channel] == at.epoch &&
+        channels[at.channel]->cq_head.load() <= at.pos) {
+      return false;
+    }
+    reclaim_handle(main_ring, d.id);
+    LOG(std::cerr << "Reclaimed response handle " << d.id << " of dead pid " << d.pid << std::endl);
+    return true;
+  };
+  auto keep = std::partition(dead_handles.begin(), dead_handles.end(), [&](const dead_handle &d) {
+    return !settled(d);
+  });
+  for (auto it = keep; it != dead_handles.end(); ++it) dead_handle_pending[it->id] = false;
+  dead_handles.erase(keep, dead_handles.end());
+  pthread_mutex_unlock(&cmdserverlock);
+}
+
+static void *cmd_ring_server_f(void *) {
+  affinity::pin_runtime_thread();
+  int fd = shm_open(ring_file_name().c_str(), O_CREAT | O_RDWR, file_access_flags);
+  if (fd < 0) {
+    printf("Failed to initialize command ring '%s'\n%s\n", ring_file_name().c_str(), strerror(errno));
+    exit(errno);
+  }
+  struct stat shm_stats{};
+  fstat(fd, &shm_stats);
+  if (shm_stats.st_size < sizeof(cmd_ring_file)) {
+    if (ftruncate(fd, sizeof(cmd_ring_file))) {
+      std::cerr << "Failed to truncate command ring file" << std::endl;
+      throw std::exception();
+    }
+  }
+  auto mapped = mmap(nullptr, sizeof(cmd_ring_file), file_access_prots, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    std::cerr << "Failed to map command ring file: " << strerror(errno) << std::endl;
+    throw std::exception();
+  }
+  auto main_ring = (cmd_ring_file *) mapped;
+  cmd_ring_file::init(*main_ring);
+  pthread_mutex_lock(&cmdserverlock);
+  std::fill(std::begin(channels), std::end(channels), nullptr);
+  std::fill(std::begin(channel_outstanding), std::end(channel_outstanding), 0);
+  std::fill(std::begin(response_channel), std::end(response_channel), -1);
+  std::fill(std::begin(channel_epoch), std::end(channel_epoch), 0);
+  channels[0] = main_ring;
+  pthread_mutex_unlock(&cmdserverlock);
+  std::cout << "Command ring served on file " << ring_file_name() << std::endl;
+
+  beethoven::rocc_cmd batch[cmd_ring_file::max_batch];
+  int ids[cmd_ring_file::max_batch];
+  bool use_cq;
+  int idle_spins = 0;
+  uint32_t seen_generation = 0;
+  bool rescan = false;
+  auto last_client_check = std::chrono::steady_clock::now();
+  int first = 0;
+  const int n_rings = cmd_ring_file::max_channels + 1;
+  auto all_empty = [&]() {
+    if (main_ring->registry_generation.load() != seen_generation) return false;
+    for (auto ch: channels) {
+      if (ch != nullptr && !ch->looks_empty()) return false;
+    }
+    return true;
+  };
+  while (true) {
+#ifdef SIM
+    if (kill_sig) break;
+#endif
+    auto generation = main_ring->registry_generation.load();
+    auto now = std::chrono::steady_clock::now();
+    bool check_clients = now - last_client_check >= client_check_interval;
+    if (generation != seen_generation || rescan || check_clients) {
+      seen_generation = generation;
+      rescan = update_channels(main_ring);
+    }
+    if (check_clients) {
+      last_client_check = now;
+      reclaim_dead_handles(main_ring);
+    }
+    // one batch per ring per round, starting from a different ring every round, so nobody can starve the others
+    bool did_work = false;
+    for (int i = 0; i < n_rings; ++i) {
+      int c = (first + i) % n_rings;
+      if (channels[c] == nullptr) continue;
+      int n = channels[c]->try_pop_batch(batch, ids, use_cq);
+      if (n == 0) continue;
+      auto received = latency_stats::now_ns();
+      pthread_mutex_lock(&cmdserverlock);
+      latency_stats::record(latency_stats::STAGE_CMD_LOCK_WAIT, latency_stats::now_ns() - received);
+      deliver_commands(batch, ids, n, use_cq ? c : -1, received);
+      pthread_mutex_unlock(&cmdserverlock);
+      did_work = true;
+    }
+    first = (first + 1) % n_rings;
+    if (did_work) {
+      idle_spins = 0;
+    } else if (++idle_spins >= ring_spins_before_sleep) {
+      // wake up every now and then to notice that we're being shut down, or that a client died
+      main_ring->wait_for_commands(1000, all_empty);
+      idle_spins = 0;
+      rescan = true;
+    }
+  }
+  return nullptr;
+}
+
 static void *cmd_server_f(void *) {
+  affinity::pin_runtime_thread();
   setup_mmio();
   // map in the shared file
-  int fd_beethoven = shm_open(cmd_server_file_name().c_str(), O_CREAT | O_RDWR, file_access_flags);
+  int fd_beethoven = shm_open(cmd_file_name().c_str(), O_CREAT | O_RDWR, file_access_flags);
   if (fd_beethoven < 0) {
-    printf("Failed to initialize cmd_file '%s'\n%s\n", cmd_server_file_name().c_str(), strerror(errno));
+    printf("Failed to initialize cmd_file '%s'\n%s\n", cmd_file_name().c_str(), strerror(errno));
     exit(errno);
   } else {
-    LOG(printf("Successfully intialized cmd_file at %s\n", cmd_server_file_name().c_str()));
+    LOG(printf("Successfully intialized cmd_file at %s\n", cmd_file_name().c_str()));
   }
   // check the file size. It might already exist in which case we don't need to truncate it again
   struct stat shm_stats{};
@@ -85,14 +409,18 @@ static void *cmd_server_f(void *) {
 #ifndef SIM
   response_poller::start_poller(&addr.processes_waiting);
 #endif
+  // the ring hands out response handles from this file's free list, so it can only be served once this is set up
+  pthread_t ring_thread;
+  pthread_create(&ring_thread, nullptr, cmd_ring_server_f, nullptr);
 
   std::vector<std::pair<int, FILE *>> alloc;
   pthread_mutex_lock(&addr.server_mut);
-  std::cout << "Command server started on file " << cmd_server_file_name() << std::endl;
+  std::cout << "Command server started on file " << cmd_file_name() << std::endl;
   pthread_mutex_lock(&addr.server_mut);
   while (true) {
 //    std::cerr << "Got Command in Server" << std::endl << std::endl;
     auto start = std::chrono::high_resolution_clock::now();
+    auto received = latency_stats::now_ns();
     // allocate space for response
     int id;
     // dont' process FLUSH commands on FPGA, they're only used
@@ -110,7 +438,9 @@ static void *cmd_server_f(void *) {
     } else {
       addr.pthread_wait_id = id = 0xffff;
     }
+    auto lock_wait_start = latency_stats::now_ns();
     pthread_mutex_lock(&cmdserverlock);
+    latency_stats::record(latency_stats::STAGE_CMD_LOCK_WAIT, latency_stats::now_ns() - lock_wait_start);
     if (addr.quit) {
       pthread_mutex_unlock(&main_lock);
 #ifdef SIM
@@ -121,46 +451,7 @@ static void *cmd_server_f(void *) {
 #endif
       return nullptr;
     }
-#if defined(FPGA) || defined(VSIM)
-#if AWS or defined(Kria)
-      // wake up response poller if this command expects a response
-      if (addr.cmd.getXd()) sem_post(&addr.processes_waiting);
-      pthread_mutex_lock(&bus_lock);
-#endif
-      uint32_t pack[5];
-      addr.cmd.pack(pack_cfg, pack);
-      //    if (sizeof(pack[0]) > 64) {
-      //      printf("FAILURE - cannot use peek-poke give the current ");
-      //      exit(1);
-      //    }
-      for (int i = 0; i < num_cmd_beats; ++i) {// command is 5 32-bit payloads
-        while (!peek_mmio(CMD_READY)) {}
-        poke_mmio(CMD_BITS, pack[i]);
-        poke_mmio(CMD_VALID, 1);
-      }
-#endif
-    LOG(std::cerr << "Successfully delivered command\n"
-                  << std::endl);
-#if AWS or defined(Kria)
-    pthread_mutex_unlock(&bus_lock);
-#else
-    // sim only
-    cmds.push(addr.cmd);
-#endif
-    // let main thread know how to return result
-    if (addr.cmd.getXd()) {
-      const auto key = system_core_pair(addr.cmd.getSystemId(), addr.cmd.getCoreId());
-      auto &m = in_flight;
-      std::queue<int> *q;
-      auto iterator = m.find(key);
-      if (iterator == m.end()) {
-        q = new std::queue<int>;
-        m[key] = q;
-      } else
-        q = iterator->second;
-      assert(id != 0xffff);
-      q->push(id);
-    }
+    deliver_commands(&addr.cmd, &id, 1, -1, received);
 
     LOG(auto end = std::chrono::high_resolution_clock::now();
                 std::cerr << "Command submission took "
@@ -172,14 +463,15 @@ static void *cmd_server_f(void *) {
     pthread_mutex_lock(&addr.server_mut);
   }
   munmap(&addr, sizeof(cmd_server_file));
-  shm_unlink(cmd_server_file_name().c_str());
+  shm_unlink(cmd_file_name().c_str());
 
 }
 
 
 cmd_server::~cmd_server() {
   munmap(&csf, sizeof(cmd_server_file));
-  shm_unlink(cmd_server_file_name().c_str());
+  shm_unlink(cmd_file_name().c_str());
+  shm_unlink(ring_file_name().c_str());
 }
 
 void cmd_server::start() {
@@ -188,11 +480,10 @@ void cmd_server::start() {
 }
 
 void register_reponse(uint32_t *r_buffer) {
+  auto start = latency_stats::now_ns();
   beethoven::rocc_response r(r_buffer, pack_cfg);
-  system_core_pair pr(r.system_id, r.core_id);
-  pthread_mutex_lock(&cmdserverlock);
-  auto it = in_flight.find(pr);
-  if (it == in_flight.end()) {
+  int id;
+  if (!in_flight.pop(r.system_id, r.core_id, id)) {
     std::cerr << "Error: Got bad response from HW: " << r_buffer[0] << " " << r_buffer[1] << " " << r_buffer[2]
               << std::endl;
 #ifdef USE_VCS
@@ -200,14 +491,32 @@ void register_reponse(uint32_t *r_buffer) {
       vpi_control(vpiFinish);
 #endif
 #endif
-    pthread_mutex_unlock(&cmdserverlock);
     pthread_mutex_unlock(&main_lock);
+    return;
+  }
+  csf->responses[id] = r;
+  // the handle's timestamps can be overwritten as soon as its owner has the response and reuses it, so take them first
+  latency_stats::response_routed(id, start);
+  int ch = response_channel[id];
+  if (ch >= 0) {
+    response_channel[id] = -1;
+    // channels come and go on the ring server thread
+    pthread_mutex_lock(&cmdserverlock);
+    channel_outstanding[ch]--;
+    if (channels[ch] != nullptr) {
+      completed_at[id] = {int16_t(ch), channel_epoch[ch], channels[ch]->cq_tail.load(std::memory_order_relaxed)};
+      channels[ch]->complete(id, r);
+    }
+    handle_in_flight[id].store(false, std::memory_order_release);
+    pthread_mutex_unlock(&cmdserverlock);
   } else {
-    int id = in_flight[pr]->front();
-    csf->responses[id] = r;
+    // The owner can resubmit on this handle as soon as it's unlocked, so it has to stop counting as in flight first.
+    // Holding cmdserverlock keeps reclaim_dead_handles() from taking the handle back in between, and the resubmission
+    // (which delivers under it) from happening before we're done
+    pthread_mutex_lock(&cmdserverlock);
+    handle_in_flight[id].store(false, std::memory_order_release);
     // allow client thread to access response
     pthread_mutex_unlock(&csf->wait_for_response[id]);
-    in_flight[pr]->pop();
     pthread_mutex_unlock(&cmdserverlock);
   }
 }
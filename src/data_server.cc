@@ -3,12 +3,18 @@
 //
 
 #include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
 #ifdef USE_VCS
 #include <vpi_user.h>
 #endif
 #include <cstring>
 #include <string>
 #include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
 
@@ -17,6 +23,10 @@
 #include <beethoven_hardware.h>
 
 #include "../include/data_server.h"
+#include "affinity.h"
+#include "data_ring.h"
+#include "shm_futex.h"
+#include "shm_arena.h"
 
 #if defined(SIM) && !defined(USE_VERILATOR)
 #include <vpi_user.h>
@@ -27,7 +37,8 @@
 #ifdef SIM
 #ifdef BEETHOVEN_HAS_DMA
 pthread_mutex_t dma_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t dma_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+std::deque<dma_descriptor> dma_queue;
+std::atomic<uint32_t> *dma_bursts_left;
 bool dma_in_progress = false;
 uint64_t dma_fpga_addr;
 bool dma_valid = false;
@@ -43,6 +54,7 @@ bool dma_write;
 #include "cmd_server.h"
 #include "fpga_utils.h"
 #include "mmio.h"
+#include "xdma_pool.h"
 
 #endif
 
@@ -67,10 +79,615 @@ static std::vector<uint16_t> available_ids;
 
 data_server_file *dsf;
 
+// read-held by every data server thread while it handles an op, so that a snapshot fork (which write-locks it) never
+// copies a half-updated translator
+pthread_rwlock_t data_server_busy = PTHREAD_RWLOCK_INITIALIZER;
+// serializes allocation and free, which share the translator's bookkeeping, the arenas and the device allocator
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+// shared-memory segment backing each allocation that isn't in an arena, keyed by its host address
+static std::map<uint64_t, std::string> alloc_names;
+// client buffers mapped in with REGISTER_BUFFER, keyed by host address. We hold on to the file so that a snapshot sweep
+// child can remap the buffer even after the client has closed it
+struct registration {
+  int fd;
+  uint64_t file_offset;
+};
+static std::map<uint64_t, registration> registered;
+// the segments that a sweep child copied its allocations into (see copy_allocations_for_sweep)
+static std::set<std::string> sweep_copies;
+
+#ifdef BEETHOVEN_USE_CUSTOM_ALLOC
+// lives outside of the server thread so that it survives a restart of the server in a forked child
+static device_allocator<ALLOCATOR_SIZE_BYTES> *allocator = nullptr;
+#endif
+
+static std::string data_file_name() {
+  return data_server_file_name() + shm_instance_suffix;
+}
+
+// one contiguous piece of a copy: `len` bytes between `host` and the device at `fpga_addr`
+struct host_range {
+  unsigned char *host;
+  uint64_t fpga_addr;
+  uint64_t len;
+};
+
+#if defined(SIM) && defined(BEETHOVEN_HAS_DMA)
+// Queue up every range of a transfer over the simulated DMA port, as bursts of random length, and wait for all of them
+// to finish. The port only moves whole 64B beats, so ranges of any other length are refused (EINVAL) before anything
+// is queued
+static int sim_dma(const std::vector<host_range> &ranges, bool write) {
+  for (const auto &r: ranges) {
+    if (r.len % 64 != 0) {
+      std::cerr << "Simulated DMA moves multiples of 64B, can't move " << r.len << "B at " << std::hex << r.fpga_addr
+                << std::dec << std::endl;
+      return EINVAL;
+    }
+  }
+  std::atomic<uint32_t> bursts_left{0};
+  std::vector<dma_descriptor> bursts;
+  for (auto r: ranges) {
+    while (r.len >= 64) {
+      auto n_beats_here = std::max(uint64_t(1), rand() % std::min(uint64_t(64), r.len >> 6));
+      bursts.push_back({r.host, r.fpga_addr, 64 * n_beats_here, write, &bursts_left});
+      r.len -= n_beats_here * 64;
+      r.host += 64 * n_beats_here;
+      r.fpga_addr += 64 * n_beats_here;
+    }
+  }
+  if (bursts.empty()) return 0;
+  bursts_left.store(bursts.size());
+  pthread_mutex_lock(&dma_lock);
+  dma_queue.insert(dma_queue.end(), bursts.begin(), bursts.end());
+  pthread_mutex_unlock(&dma_lock);
+  // the simulation only wakes us once the last burst is done
+  for (uint32_t n; (n = bursts_left.load()) != 0;) shm_futex::wait(&bursts_left, n);
+  return 0;
+}
+
+// Hand a FILL or COPY of the backing store to the simulated DMA port and wait for it to finish (see dma_kind)
+static void sim_backing_op(dma_kind kind, unsigned char *dst, uint64_t fpga_addr, const unsigned char *src, int value,
+                           uint64_t len) {
+  std::atomic<uint32_t> bursts_left{1};
+  pthread_mutex_lock(&dma_lock);
+  dma_queue.push_back({dst, fpga_addr, len, true, &bursts_left, kind, src, value});
+  pthread_mutex_unlock(&dma_lock);
+  for (uint32_t n; (n = bursts_left.load()) != 0;) shm_futex::wait(&bursts_left, n);
+}
+
+#endif
+#if defined(FPGA) && !defined(Kria)
+enum dma_pin_mode {
+  PIN_OFF,
+  PIN_PREFAULT,
+  PIN_MLOCK
+};
+
+// BEETHOVEN_XDMA_PIN=prefault|mlock. XDMA pins the pages of every transfer itself, but faulting in a fresh allocation's
+// pages in the middle of its first transfer is slow, so we can do that up front at ALLOC, or even lock them in
+static dma_pin_mode dma_pinning() {
+  static dma_pin_mode mode = [] {
+    const char *v = getenv("BEETHOVEN_XDMA_PIN");
+    if (v == nullptr || !strcmp(v, "off")) return PIN_OFF;
+    if (!strcmp(v, "prefault")) return PIN_PREFAULT;
+    if (!strcmp(v, "mlock")) return PIN_MLOCK;
+    std::cerr << "Unrecognized BEETHOVEN_XDMA_PIN '" << v << "'. Expected off, prefault or mlock" << std::endl;
+    throw std::exception();
+  }();
+  return mode;
+}
+
+static void prepare_for_dma(void *p, uint64_t len) {
+  switch (dma_pinning()) {
+    case PIN_OFF:
+      break;
+    case PIN_PREFAULT: {
+      // writing one byte per page would also do, but would race with a client that's already filling the buffer
+#ifdef MADV_POPULATE_WRITE
+      if (madvise(p, len, MADV_POPULATE_WRITE) == 0) break;
+#endif
+      auto page = sysconf(_SC_PAGESIZE);
+      volatile char sink = 0;
+      for (uint64_t off = 0; off < len; off += page) sink += ((volatile char *) p)[off];
+      break;
+    }
+    case PIN_MLOCK:
+      if (mlock(p, len)) {
+        std::cerr << "Failed to mlock " << len << "B for DMA (" << strerror(errno) << "). Check ulimit -l" << std::endl;
+      }
+      break;
+  }
+}
+
+#endif
+
+// Files that clients have handed us over the data ring's socket for REGISTER_BUFFER, by the cookie we gave back for
+// each. Clients that never come back for theirs lose them to newer ones once there are too many
+static pthread_mutex_t passed_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<uint64_t, int> passed_fds;
+static std::deque<uint64_t> passed_fds_order;
+static const size_t max_passed_fds = 256;
+
+static uint64_t keep_passed_fd(int fd) {
+  uint64_t cookie = 0;
+  while (cookie == 0) {
+    if (getrandom(&cookie, sizeof(cookie), 0) != sizeof(cookie)) return 0;
+  }
+  pthread_mutex_lock(&passed_fds_lock);
+  while (passed_fds.size() >= max_passed_fds) {
+    auto it = passed_fds.find(passed_fds_order.front());
+    passed_fds_order.pop_front();
+    if (it == passed_fds.end()) continue;
+    close(it->second);
+    passed_fds.erase(it);
+  }
+  passed_fds[cookie] = fd;
+  passed_fds_order.push_back(cookie);
+  pthread_mutex_unlock(&passed_fds_lock);
+  return cookie;
+}
+
+// the fd behind `cookie`, or -1. Each one can only be taken once
+static int take_passed_fd(uint64_t cookie) {
+  pthread_mutex_lock(&passed_fds_lock);
+  int fd = -1;
+  auto it = passed_fds.find(cookie);
+  if (it != passed_fds.end()) {
+    fd = it->second;
+    passed_fds.erase(it);
+  }
+  pthread_mutex_unlock(&passed_fds_lock);
+  return fd;
+}
+
+// REGISTER_BUFFER: map args[0] bytes at offset args[1] of the file that the client passed us as the cookie args[2],
+// and give the device an address for them. On the way out, args[0] is that address, like for ALLOC. Returns 0, or an
+// errno value if the buffer can't be registered
+static int register_buffer(uint64_t *args) {
+  int fd = take_passed_fd(args[2]);
+  args[0] = 0;
+  if (fd < 0) return EBADF;
+#if defined(FPGA) && defined(Kria)
+  fprintf(stderr, "In Embedded FPGA runtime, client is attempting to register a buffer with the server. The device "
+                  "needs physically contiguous memory, allocate it locally instead.\n");
+  fflush(stderr);
+  close(fd);
+  return ENOTSUP;
+#endif
+  auto nBytes = args[0];
+  auto file_offset = args[1];
+  struct stat st{};
+  // touching a page past the end of the file would SIGBUS the whole runtime, not just this client
+  int err = 0;
+  if (file_offset % sysconf(_SC_PAGESIZE) != 0 || nBytes == 0) err = EINVAL;
+  else if (fstat(fd, &st)) err = errno;
+  else if (!S_ISREG(st.st_mode) || uint64_t(st.st_size) < file_offset + nBytes) err = EINVAL;
+  // the device is going to write it, so the client must have been able to as well
+  else if ((fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDWR) err = EACCES;
+  if (err) {
+    close(fd);
+    return err;
+  }
+  void *naddr = mmap(nullptr, nBytes, file_access_prots, MAP_SHARED, fd, (off_t) file_offset);
+  if (naddr == MAP_FAILED) {
+    err = errno;
+    close(fd);
+    return err;
+  }
+#if defined(FPGA) && !defined(Kria)
+  prepare_for_dma(naddr, nBytes);
+#endif
+  pthread_mutex_lock(&alloc_lock);
+  registered[(uint64_t) naddr] = {fd, file_offset};
+#ifdef BEETHOVEN_USE_CUSTOM_ALLOC
+  auto fpga_addr = allocator->malloc(nBytes);
+#else
+  auto fpga_addr = (uint64_t) naddr;
+#endif
+  at.add_mapping(fpga_addr, nBytes, naddr);
+  pthread_mutex_unlock(&alloc_lock);
+  LOG(printf("Registered %llu bytes of fd %d at %p. FPGA addr %llx\n", nBytes, fd, naddr, fpga_addr));
+  args[0] = fpga_addr;
+  return 0;
+}
+
+// Device ranges [start, end) that a move is reading or writing through its host mapping right now. Moves run on their
+// own workers, without alloc_lock, so FREE waits until none of these overlaps the allocation before it unmaps it
+static pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pin_released = PTHREAD_COND_INITIALIZER;
+static std::multiset<std::pair<uint64_t, uint64_t>> pinned;
+
+// The ranges that one move has pinned. They're released when it goes out of scope, and moves don't return before
+// their transfer is done
+class pinned_ranges {
+public:
+  pinned_ranges() = default;
+  pinned_ranges(const pinned_ranges &) = delete;
+  pinned_ranges &operator=(const pinned_ranges &) = delete;
+
+  // at.translate_range(), except that the memory stays mapped until this is destroyed
+  void *pin(uint64_t fpga_addr, uint64_t len) {
+    pthread_mutex_lock(&pin_lock);
+    auto host = at.translate_range(fpga_addr, len);
+    // inside an allocation, so the end can't wrap
+    if (host != nullptr) held.push_back(pinned.emplace(fpga_addr, fpga_addr + len));
+    pthread_mutex_unlock(&pin_lock);
+    return host;
+  }
+
+  ~pinned_ranges() {
+    if (held.empty()) return;
+    pthread_mutex_lock(&pin_lock);
+    for (auto it: held) pinned.erase(it);
+    pthread_cond_broadcast(&pin_released);
+    pthread_mutex_unlock(&pin_lock);
+  }
+
+private:
+  std::vector<std::multiset<std::pair<uint64_t, uint64_t>>::iterator> held;
+};
+
+// Drop the mapping of the `len` bytes at `fpga_addr`, so that no new move can translate into them, and wait for the
+// moves that already have to finish with them
+static void remove_mapping_and_drain(uint64_t fpga_addr, uint64_t len) {
+  pthread_mutex_lock(&pin_lock);
+  at.remove_mapping(fpga_addr);
+  auto busy = [&]() {
+    return std::any_of(pinned.begin(), pinned.end(), [&](const std::pair<uint64_t, uint64_t> &p) {
+      return p.first < fpga_addr + len && fpga_addr < p.second;
+    });
+  };
+  while (busy()) pthread_cond_wait(&pin_released, &pin_lock);
+  pthread_mutex_unlock(&pin_lock);
+}
+
+// MOVE_SG_TO_FPGA/MOVE_SG_FROM_FPGA: args[0] is the device address of an allocation holding args[1] sg_descriptors,
+// and args[2] is the base that their host offsets are relative to (see data_ring.h). The list, and both sides of every
+// range in it, must lie inside a single allocation each (EFAULT otherwise), and nothing moves unless they all do
+static int run_sg_move(bool to_fpga, const uint64_t *args) {
+  if (args[1] > UINT64_MAX / sizeof(sg_descriptor)) return EINVAL;
+  pinned_ranges pins;
+  auto list = (const sg_descriptor *) pins.pin(args[0], args[1] * sizeof(sg_descriptor));
+  if (list == nullptr && args[1] != 0) return EFAULT;
+  std::vector<host_range> ranges;
+  for (uint64_t i = 0; i < args[1]; ++i) {
+    // the client can still be writing the list, so read each descriptor once
+    auto d = list[i];
+    if (d.len == 0) continue;
+    auto host = (unsigned char *) pins.pin(args[2] + d.host_offset, d.len);
+    if (host == nullptr || pins.pin(d.fpga_addr, d.len) == nullptr) {
+      std::cerr << "Scatter-gather descriptor " << i << " (" << std::hex << d.fpga_addr << ", " << d.host_offset
+                << ", " << std::dec << d.len << ") runs outside of its allocations" << std::endl;
+      return EFAULT;
+    }
+    // coalesce with the previous range if this one picks up where it left off, on both sides
+    if (!ranges.empty()) {
+      auto &last = ranges.back();
+      if (last.fpga_addr + last.len == d.fpga_addr && last.host + last.len == host) {
+        last.len += d.len;
+        continue;
+      }
+    }
+    ranges.push_back({host, d.fpga_addr, d.len});
+  }
+#if defined(SIM) && defined(BEETHOVEN_HAS_DMA)
+  // every burst of every range goes into the DMA queue at once, so they run back-to-back
+  return sim_dma(ranges, to_fpga);
+#elif defined(FPGA) && !defined(Kria)
+  for (const auto &r: ranges) {
+    int rc = to_fpga ? xdma_pool::write(r.host, r.len, r.fpga_addr) : xdma_pool::read(r.host, r.len, r.fpga_addr);
+    if (rc) {
+      fprintf(stderr, "Something failed inside a scatter-gather %s - %d %p %ld %lx\n", to_fpga ? "write" : "read", rc,
+              r.host, r.len, r.fpga_addr);
+      return EIO;
+    }
+  }
+  return 0;
+#elif defined(FPGA) && defined(Kria)
+  (void) ranges;
+  fprintf(stderr, "In Embedded FPGA runtime, client is attempting a scatter-gather move. The host and device share "
+                  "memory, there's nothing to move\n");
+  return ENOTSUP;
+#else
+  // like MOVE_TO/FROM_FPGA, nothing to do without a DMA port
+  (void) ranges;
+  (void) to_fpga;
+  return 0;
+#endif
+}
+
+// FILL_FPGA and COPY_FPGA: set args[2] bytes of device memory at args[0] to the byte args[1], or copy them there from
+// the device address args[1] (see data_ring.h). Returns EFAULT if a range runs outside of its allocation and EINVAL if
+// the two ranges of a copy overlap
+static int run_device_op(uint32_t operation, const uint64_t *args) {
+#if defined(FPGA) && defined(Kria)
+  fprintf(stderr, "In Embedded FPGA runtime, client is attempting a device fill or copy through the server. The host "
+                  "and device share memory, do it locally instead.\n");
+  fflush(stderr);
+  return ENOTSUP;
+#endif
+  auto dst = args[0], len = args[2];
+  if (len == 0) return 0;
+  pinned_ranges pins;
+  auto dst_host = (unsigned char *) pins.pin(dst, len);
+  if (dst_host == nullptr) return EFAULT;
+  const unsigned char *src_host = nullptr;
+  if (operation == COPY_FPGA) {
+    auto src = args[1];
+    src_host = (const unsigned char *) pins.pin(src, len);
+    if (src_host == nullptr) return EFAULT;
+    // both ranges are inside allocations, so these can't wrap
+    if (src < dst + len && dst < src + len) return EINVAL;
+  }
+#if defined(SIM)
+#if defined(BEETHOVEN_HAS_DMA)
+  sim_backing_op(operation == FILL_FPGA ? DMA_FILL : DMA_COPY, dst_host, dst, src_host, int(args[1] & 0xFF), len);
+#else
+  if (operation == FILL_FPGA) memset(dst_host, int(args[1] & 0xFF), len);
+  else memcpy(dst_host, src_host, len);
+#endif
+  return 0;
+#elif defined(FPGA) && !defined(Kria)
+  int rc = operation == FILL_FPGA ? xdma_pool::fill(uint8_t(args[1]), len, dst) : xdma_pool::copy(dst, args[1], len);
+  if (rc) {
+    fprintf(stderr, "Something failed inside a device %s - %d %lx %ld\n", operation == FILL_FPGA ? "fill" : "copy", rc,
+            dst, len);
+    return EIO;
+  }
+  return 0;
+#endif
+}
+
+// MOVE_TO_FPGA/MOVE_FROM_FPGA name an allocation by its device address. A range that runs outside of it would have the
+// DMA read or write past the mapping, so refuse it
+[[maybe_unused]] static int move_out_of_bounds(const char *op, uint64_t fpga_addr, uint64_t len) {
+  std::cerr << op << " of " << len << "B at " << std::hex << fpga_addr << std::dec << " runs outside of its allocation"
+            << std::endl;
+  return EFAULT;
+}
+
+// Carry out one data op. The arguments come in, and the results go back out, in the same fields that the
+// data_server_file uses for them: op_argument, op2_argument and op3_argument are args[0..2]. Returns 0, or an errno
+// value if the op failed. `resp_id` only comes back from coherence ops
+static int run_op(uint32_t operation, uint64_t *args, char *fname_out, [[maybe_unused]] int &resp_id) {
+  if (operation == REGISTER_BUFFER) return register_buffer(args);
+  if (operation == MOVE_SG_TO_FPGA || operation == MOVE_SG_FROM_FPGA) {
+    return run_sg_move(operation == MOVE_SG_TO_FPGA, args);
+  }
+  if (operation == FILL_FPGA || operation == COPY_FPGA) return run_device_op(operation, args);
+  switch ((data_server_op) operation) {
+    case data_server_op::ALLOC: {
+#if defined(FPGA) && defined(Kria)
+      fprintf(stderr, "In Embedded FPGA runtime, client is attempting to allocate memory from"
+                      "server. Allocations should only happen locally except for discrete boards.");
+      fflush(stderr);
+      break;
+#endif
+      pthread_mutex_lock(&alloc_lock);
+      std::string fname;
+      void *naddr;
+      if (shm_arena::arena_bytes()) {
+        auto a = shm_arena::alloc(args[0]);
+        fname = shm_arena::response_prefix + a.name;
+        // the name goes back in a fixed-size field, and a hugetlbfs mount can be anywhere
+        if (fname.size() >= std::min(sizeof(data_server_file::fname), sizeof(data_ring_file::token::fname))) {
+          std::cerr << "Arena name '" << a.name << "' is too long to hand back to the client" << std::endl;
+          shm_arena::free(a.cpu_addr);
+          pthread_mutex_unlock(&alloc_lock);
+          args[0] = 0;
+          return ENAMETOOLONG;
+        }
+        naddr = a.cpu_addr;
+        args[1] = a.offset;
+        args[2] = a.arena_size;
+      } else {
+        fname = "/beethoven_file_" + std::to_string(rand());// NOLINT(cert-msc50-cpp)
+        int nfd = shm_open(fname.c_str(), O_CREAT | O_RDWR, file_access_flags);
+        if (nfd < 0) {
+          std::cerr << "Failed to open shared memory segment: " << std::string(strerror(errno)) << std::endl;
+          throw std::exception();
+        }
+        int rc = ftruncate(nfd, (off_t) args[0]);
+        if (rc) {
+          std::cerr << "Failed to truncate!" << std::endl;
+          //          printf("Failed to truncate! - %d, %d, %llu\t %s\n", rc, nfd, (off_t) args[0], strerror(errno));
+          throw std::exception();
+        }
+        // clients shm_open() these, so a hugetlbfs file is out of the question. THP is the best we can do
+        auto kind = args[0] >= shm_arena::huge_page_bytes ? std::min(shm_arena::requested_pages(), shm_arena::PAGES_THP)
+                                                          : shm_arena::PAGES_SMALL;
+        naddr = shm_arena::map_segment(nfd, args[0], kind);
+        // the mapping keeps the segment alive. Holding on to the fd too would run us out of them
+        close(nfd);
+
+        if (naddr == MAP_FAILED) {
+          std::cerr << "Failed to mmap address: " << std::string(strerror(errno)) << std::endl;
+          throw std::exception();
+        }
+        // a freshly truncated segment already reads as zero, no need to memset it
+        alloc_names[(uint64_t) naddr] = fname;
+      }
+      auto nBytes = args[0];
+#if defined(FPGA) && !defined(Kria)
+      prepare_for_dma(naddr, nBytes);
+#endif
+#ifdef Kria
+      unsigned int cacheLineSz = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+      char *ptr = (char *) naddr;
+      for (uint64_t i = 0; i < args[0] / cacheLineSz; ++i) {
+        asm volatile("DC CIVAC, %0" ::"r"(ptr)
+                     : "memory");
+        ptr += cacheLineSz;
+      }
+#endif
+      //write response
+      // copy file name to response field
+      memcpy(fname_out, fname.c_str(), fname.size() + 1);
+      // allocate memory
+#ifdef BEETHOVEN_USE_CUSTOM_ALLOC
+      auto fpga_addr = allocator->malloc(args[0]);
+      at.add_mapping(fpga_addr, args[0], naddr);
+      // return fpga address
+      args[0] = fpga_addr;
+      LOG(printf("Allocated %llu bytes at %p. FPGA addr %llx\n", nBytes, naddr, fpga_addr));
+#else
+      auto fpga_addr = (uint64_t) naddr;
+      at.add_mapping(fpga_addr, args[0], naddr);
+      args[0] = fpga_addr;
+#endif
+      // add mapping in server
+      pthread_mutex_unlock(&alloc_lock);
+      break;
+    }
+    case data_server_op::FREE: {
+      pthread_mutex_lock(&alloc_lock);
+      auto mapping = at.get_mapping(args[0]);
+      LOG(printf("Freeing %llu bytes at %p\n", mapping.second, mapping.first); fflush(stdout));
+      // nobody must be able to translate into the memory once it's gone, so drop the mapping first. A move that already
+      // has gets to finish before either the host memory or the device range can be handed out again
+      remove_mapping_and_drain(args[0], mapping.second);
+#ifdef BEETHOVEN_USE_CUSTOM_ALLOC
+      allocator->free(args[0]);
+#endif
+#if defined(FPGA) && !defined(Kria)
+      if (dma_pinning() == PIN_MLOCK) munlock(mapping.first, mapping.second);
+#endif
+      if (!shm_arena::free(mapping.first)) {
+        munmap(mapping.first, mapping.second);
+        alloc_names.erase((uint64_t) mapping.first);
+        // the client's file itself is theirs to keep
+        auto reg = registered.find((uint64_t) mapping.first);
+        if (reg != registered.end()) {
+          close(reg->second.fd);
+          registered.erase(reg);
+        }
+      }
+      pthread_mutex_unlock(&alloc_lock);
+      break;
+    }
+#if defined(SIM)
+    case data_server_op::MOVE_TO_FPGA: {
+#if defined(BEETHOVEN_HAS_DMA) and defined(SIM)
+      pinned_ranges pins;
+      auto host = (unsigned char *) pins.pin(args[0], args[2]);
+      if (host == nullptr) return move_out_of_bounds("MOVE_TO_FPGA", args[0], args[2]);
+      return sim_dma({{host, args[0], args[2]}}, true);
+#endif
+      break;
+    }
+    case data_server_op::MOVE_FROM_FPGA: {
+#if defined(BEETHOVEN_HAS_DMA) and defined(SIM)
+      pinned_ranges pins;
+      auto host = (unsigned char *) pins.pin(args[1], args[2]);
+      if (host == nullptr) return move_out_of_bounds("MOVE_FROM_FPGA", args[1], args[2]);
+      return sim_dma({{host, args[1], args[2]}}, false);
+#endif
+      break;
+    }
+#elif defined(FPGA) && !defined(Kria)
+    case data_server_op::MOVE_FROM_FPGA: {
+      pinned_ranges pins;
+      auto shaddr = pins.pin(args[1], args[2]);
+      if (shaddr == nullptr) return move_out_of_bounds("MOVE_FROM_FPGA", args[1], args[2]);
+      // straight into the shared segment, the client sees the data as soon as the DMA lands
+      int rc = xdma_pool::read((uint8_t *) shaddr, args[2], args[1]);
+      if (rc) {
+        fprintf(stderr, "Something failed inside MOVE_FROM_FPGA - %d %p %ld %lx\n", rc, shaddr, args[2], args[1]);
+        return EIO;
+      }
+      break;
+    }
+    case data_server_op::MOVE_TO_FPGA: {
+      pinned_ranges pins;
+      auto shaddr = pins.pin(args[0], args[2]);
+      if (shaddr == nullptr) return move_out_of_bounds("MOVE_TO_FPGA", args[0], args[2]);
+      int rc = xdma_pool::write((uint8_t *) shaddr, args[2], args[0]);
+      if (rc) {
+        fprintf(stderr, "Something failed inside MOVE_TO_FPGA - %d %p %ld %lx\n", rc, shaddr, args[2], args[0]);
+        return EIO;
+      }
+      break;
+    }
+#elif defined(Kria)
+    case data_server_op::MOVE_TO_FPGA:
+    case data_server_op::MOVE_FROM_FPGA:
+      fprintf(stderr, "Kria backend attempting to do unsupported op in data server\n");
+      break;
+#ifdef HAS_COHERENCE
+    case data_server_op::INVALIDATE_REGION:
+    case data_server_op::CLEAN_INVALIDATE_REGION:
+    case data_server_op::RELEASE_COHERENCE_BARRIER:
+    case data_server_op::ADD_TO_COHERENCE_MANAGER: {
+      LOG(std::cerr << "Recieved coherence command" << std::endl);
+      uint16_t id;
+      if (operation == ADD_TO_COHERENCE_MANAGER) {
+        id = available_ids.back();
+        available_ids.pop_back();
+      } else {
+        id = args[0];
+      }
+      if (id < 0 && operation != data_server_op::RELEASE_COHERENCE_BARRIER) {
+        resp_id = -1;
+        fprintf(stderr, "Recieved invalid ID on data server during coherence command");
+        break;
+      }
+      pthread_mutex_lock(&bus_lock);
+      // this arguments are ignored by `add` operation so doesn't matter
+      uint64_t &a = args[0];
+      uint64_t &l = args[1];
+      for (int i = 0; i < 2; ++i) {// command is 5 32-bit payloads
+        while (!peek_mmio(COHERENCE_READY)) {}
+        poke_mmio(COHERENCE_BITS, ((uint32_t *) (&a))[i]);
+        poke_mmio(COHERENCE_VALID, 1);
+      }
+      for (int i = 0; i < 2; ++i) {// command is 5 32-bit payloads
+        while (!peek_mmio(COHERENCE_READY)) {}
+        poke_mmio(COHERENCE_BITS, ((uint32_t *) (&l))[i]);
+        poke_mmio(COHERENCE_VALID, 1);
+      }
+      uint32_t command;
+      switch (operation) {
+        case data_server_op::INVALIDATE_REGION:
+          command = COHERENCE_OP_INVALIDATE;
+          LOG(std::cerr << "INVALIDATE COMMAND" << std::endl);
+          break;
+        case data_server_op::CLEAN_INVALIDATE_REGION:
+          command = COHERENCE_OP_CLEAN_INVALIDATE;
+          LOG(std::cerr << "CLEAN INVALIDATE COMMAND" << std::endl);
+          break;
+        case data_server_op::ADD_TO_COHERENCE_MANAGER:
+          LOG(fprintf(stderr, "REGISTER COHERENT SEGMENT: %16lx\n", args[0]);
+              fflush(stderr));
+          command = COHERENCE_OP_ADD;
+          break;
+        case data_server_op::RELEASE_COHERENCE_BARRIER:
+          LOG(std::cerr << "RELEASE COHERENCE BARRIER" << std::endl);
+          command = COHERENCE_OP_BARRIER_RELEASE;
+          break;
+      }
+      command |= (id & 0xFFFF) << 2;
+
+      while (!peek_mmio(COHERENCE_READY)) {}
+      poke_mmio(COHERENCE_BITS, command);
+      poke_mmio(COHERENCE_VALID, 1);
+      pthread_mutex_unlock(&bus_lock);
+      resp_id = id;
+
+      break;
+    }
+#endif
+#else
+#error("Doesn't appear that we're covering all cases inside data server")
+#endif
+  }
+  return 0;
+}
+
 [[noreturn]] static void *data_server_f(void *) {
-  int fd_beethoven = shm_open(data_server_file_name().c_str(), O_CREAT | O_RDWR, file_access_flags);
+  affinity::pin_runtime_thread();
+  int fd_beethoven = shm_open(data_file_name().c_str(), O_CREAT | O_RDWR, file_access_flags);
   if (fd_beethoven < 0) {
-    std::cerr << "Failed to open data_server file: '" << data_server_file_name << "'" << std::endl;
+    std::cerr << "Failed to open data_server file: '" << data_file_name() << "'" << std::endl;
     throw std::exception();
   }
 
@@ -89,11 +706,6 @@ data_server_file *dsf;
   auto &addr = *(data_server_file *) mmap(nullptr, sizeof(data_server_file), file_access_prots,
                                           MAP_SHARED, fd_beethoven, 0);
 
-#ifdef BEETHOVEN_USE_CUSTOM_ALLOC
-  LOG(std::cerr << "Constructing allocator" << std::endl);
-  auto allocator = new device_allocator<ALLOCATOR_SIZE_BYTES>();
-  LOG(std::cerr << "Allocator constructed - data server ready" << std::endl);
-#endif
   data_server_file::init(addr);
   LOG(std::cerr << "Data server file constructed" << std::endl);
 
@@ -142,242 +754,25 @@ data_server_file *dsf;
     available_ids.push_back(i);
 #endif
 
-  srand(time(nullptr));// NOLINT(cert-msc51-cpp)
   pthread_mutex_lock(&addr.server_mut);
   pthread_mutex_lock(&addr.server_mut);
-#if defined(SIM) && defined(BEETHOVEN_HAS_DMA)
-  pthread_mutex_lock(&dma_wait_lock);
-#endif
   while (true) {
+    pthread_rwlock_rdlock(&data_server_busy);
     //    printf("data server got cmd\n"); fflush(stdout);
-    // get file name, descriptor, expand the file, and map it to address space
-    switch (addr.operation) {
-      case data_server_op::ALLOC: {
-#if defined(FPGA) && defined(Kria)
-        fprintf(stderr, "In Embedded FPGA runtime, client is attempting to allocate memory from"
-                        "server. Allocations should only happen locally except for discrete boards.");
-        fflush(stderr);
-        break;
-#endif
-        auto fname = "/beethoven_file_" + std::to_string(rand());// NOLINT(cert-msc50-cpp)
-        int nfd = shm_open(fname.c_str(), O_CREAT | O_RDWR, file_access_flags);
-        if (nfd < 0) {
-          std::cerr << "Failed to open shared memory segment: " << std::string(strerror(errno)) << std::endl;
-          throw std::exception();
-        }
-        int rc = ftruncate(nfd, (off_t) addr.op_argument);
-        if (rc) {
-          std::cerr << "Failed to truncate!" << std::endl;
-          //          printf("Failed to truncate! - %d, %d, %llu\t %s\n", rc, nfd, (off_t) addr.op_argument, strerror(errno));
-          throw std::exception();
-        }
-        void *naddr = mmap(nullptr, addr.op_argument, file_access_prots, MAP_SHARED, nfd, 0);
-
-
-        if (naddr == nullptr) {
-          std::cerr << "Failed to mmap address: " << std::string(strerror(errno)) << std::endl;
-          throw std::exception();
-        }
-        memset(naddr, 0, addr.op_argument);
-        auto nBytes = addr.op_argument;
-#ifdef Kria
-        unsigned int cacheLineSz = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
-        char *ptr = (char *) naddr;
-        for (uint64_t i = 0; i < addr.op_argument / cacheLineSz; ++i) {
-          asm volatile("DC CIVAC, %0" ::"r"(ptr)
-                       : "memory");
-          ptr += cacheLineSz;
-        }
-#endif
-        //write response
-        // copy file name to response field
-        strcpy(addr.fname, fname.c_str());
-        // allocate memory
-#ifdef BEETHOVEN_USE_CUSTOM_ALLOC
-        auto fpga_addr = allocator->malloc(addr.op_argument);
-        at.add_mapping(fpga_addr, addr.op_argument, naddr);
-        // return fpga address
-        addr.op_argument = fpga_addr;
-        LOG(printf("Allocated %llu bytes at %p. FPGA addr %llx\n", nBytes, naddr, fpga_addr));
-#else
-        auto fpga_addr = (uint64_t) naddr;
-        at.add_mapping(fpga_addr, addr.op_argument, naddr);
-        addr.op_argument = fpga_addr;
-#endif
-        // add mapping in server
-        break;
-      }
-      case data_server_op::FREE:
-#ifdef BEETHOVEN_USE_CUSTOM_ALLOC
-        allocator->free(addr.op_argument);
-#endif
-        LOG(printf("Freeing %llu bytes at %p\n", at.get_mapping(addr.op_argument).second, at.get_mapping(addr.op_argument).first);
-            fflush(stdout));
-        munmap(at.get_mapping(addr.op_argument).first, at.get_mapping(addr.op_argument).second);
-        at.remove_mapping(addr.op_argument);
-        break;
-#if defined(SIM)
-      case data_server_op::MOVE_TO_FPGA: {
-        std::cerr << at.get_mapping(addr.op_argument).first << std::endl;
-#if defined(BEETHOVEN_HAS_DMA) and defined(SIM)
-        auto amt_left = addr.op3_argument;
-        auto ptr1 = (unsigned char *) at.translate(addr.op_argument);
-        auto ptr2 = addr.op_argument;
-        if (amt_left % 64 != 0) {
-          printf("NOT ALIGNED OOF DATA\n");
-        }
-        while (amt_left > 0) {
-          pthread_mutex_lock(&dma_lock);
-          auto n_beats_here = std::max(uint64_t(1), rand() % std::min(uint64_t(64), amt_left >> 6));
-          dma_len = 64 * n_beats_here;
-//          printf("REMAINING %d - %x\n", amt_left, dma_len);
-          dma_ptr = ptr1;
-          amt_left -= n_beats_here * 64;
-          dma_fpga_addr = ptr2;
-          dma_valid = true;
-          dma_write = true;
-          dma_in_progress = false;
-          pthread_mutex_unlock(&dma_lock);
-          pthread_mutex_lock(&dma_wait_lock);
-          ptr1 += 64 * n_beats_here;
-          ptr2 += 64 * n_beats_here;
-        }
-#endif
-        //        std::cerr << "finish DMA " << std::endl;
-        break;
-      }
-      case data_server_op::MOVE_FROM_FPGA: {
-        std::cerr << at.get_mapping(addr.op2_argument).first << std::endl;
-#if defined(BEETHOVEN_HAS_DMA) and defined(SIM)
-        auto ptr1 = (unsigned char *) at.translate(addr.op2_argument);
-        auto ptr2 = addr.op2_argument;
-        auto amt_left = addr.op3_argument;
-        while (amt_left > 0) {
-          auto n_beats_here = std::max(uint64_t(1), rand() % std::min(uint64_t(64), amt_left >> 6));
-          pthread_mutex_lock(&dma_lock);
-          dma_len = 64 * n_beats_here;
-          amt_left -= n_beats_here * 64;
-          dma_ptr = ptr1;
-          dma_fpga_addr = ptr2;
-          dma_valid = true;
-          dma_write = false;
-          dma_in_progress = false;
-          pthread_mutex_unlock(&dma_lock);
-          pthread_mutex_lock(&dma_wait_lock);
-          ptr1 += 64 * n_beats_here;
-          ptr2 += 64 * n_beats_here;
-        }
-#endif
-        break;
-      }
-#elif defined(FPGA) && !defined(Kria)
-      case data_server_op::MOVE_FROM_FPGA: {
-        auto shaddr = at.translate(addr.op2_argument);
-        //        std::cout << "from fpga addr: " << addr.op2_argument << std::endl;
-        auto *mem = (uint8_t *) malloc(addr.op3_argument);
-        int rc = wrapper_fpga_dma_burst_read(xdma_read_fd, (uint8_t *) mem, addr.op3_argument, addr.op2_argument);
-        memcpy(shaddr, mem, addr.op3_argument);
-        free(mem);
-        //        for (int i = 0; i < addr.op3_argument / sizeof(int); ++i)
-        //          printf("%d ", ((int *) shaddr)[i]);
-        //        fflush(stdout);
-        if (rc) {
-          fprintf(stderr, "Something failed inside MOVE_FROM_FPGA - %d %p %ld %lx\n", xdma_read_fd, shaddr,
-                  addr.op3_argument, addr.op2_argument);
-          exit(1);
-        }
-        break;
-      }
-      case data_server_op::MOVE_TO_FPGA: {
-        auto shaddr = at.translate(addr.op_argument);
-        //        printf("trying to transfer\n"); fflush(stdout);
-        //        std::cout << "to fpga addr: " << addr.op_argument << std::endl;
-        //        for (int i = 0; i < addr.op3_argument / sizeof(int); ++i)
-        //          printf("%d ", ((int *) shaddr)[i]);
-        //        fflush(stdout);
-        auto *mem = (uint8_t *) malloc(addr.op3_argument);
-        memcpy(mem, shaddr, addr.op3_argument);
-        int rc = wrapper_fpga_dma_burst_write(xdma_write_fd, (uint8_t *) shaddr, addr.op3_argument, addr.op_argument);
-        if (rc) {
-          fprintf(stderr, "Something failed inside MOVE_TO_FPGA - %d %p %ld %lx\n", xdma_write_fd, shaddr,
-                  addr.op3_argument, addr.op2_argument);
-          exit(1);
-        }
-        //        printf("finished transfering\n"); fflush(stdout);
-        break;
-      }
-#elif defined(Kria)
-      case data_server_op::MOVE_TO_FPGA:
-      case data_server_op::MOVE_FROM_FPGA:
-        fprintf(stderr, "Kria backend attempting to do unsupported op in data server\n");
-        break;
-#ifdef HAS_COHERENCE
-      case data_server_op::INVALIDATE_REGION:
-      case data_server_op::CLEAN_INVALIDATE_REGION:
-      case data_server_op::RELEASE_COHERENCE_BARRIER:
-      case data_server_op::ADD_TO_COHERENCE_MANAGER: {
-        LOG(std::cerr << "Recieved coherence command" << std::endl);
-        uint16_t id;
-        if (addr.operation == ADD_TO_COHERENCE_MANAGER) {
-          id = available_ids.back();
-          available_ids.pop_back();
-        } else {
-          id = addr.op_argument;
-        }
-        if (id < 0 && addr.operation != data_server_op::RELEASE_COHERENCE_BARRIER) {
-          addr.resp_id = -1;
-          fprintf(stderr, "Recieved invalid ID on data server during coherence command");
-          break;
-        }
-        pthread_mutex_lock(&bus_lock);
-        // this arguments are ignored by `add` operation so doesn't matter
-        uint64_t &a = addr.op_argument;
-        uint64_t &l = addr.op2_argument;
-        for (int i = 0; i < 2; ++i) {// command is 5 32-bit payloads
-          while (!peek_mmio(COHERENCE_READY)) {}
-          poke_mmio(COHERENCE_BITS, ((uint32_t *) (&a))[i]);
-          poke_mmio(COHERENCE_VALID, 1);
-        }
-        for (int i = 0; i < 2; ++i) {// command is 5 32-bit payloads
-          while (!peek_mmio(COHERENCE_READY)) {}
-          poke_mmio(COHERENCE_BITS, ((uint32_t *) (&l))[i]);
-          poke_mmio(COHERENCE_VALID, 1);
-        }
-        uint32_t command;
-        switch (addr.operation) {
-          case data_server_op::INVALIDATE_REGION:
-            command = COHERENCE_OP_INVALIDATE;
-            LOG(std::cerr << "INVALIDATE COMMAND" << std::endl);
-            break;
-          case data_server_op::CLEAN_INVALIDATE_REGION:
-            command = COHERENCE_OP_CLEAN_INVALIDATE;
-            LOG(std::cerr << "CLEAN INVALIDATE COMMAND" << std::endl);
-            break;
-          case data_server_op::ADD_TO_COHERENCE_MANAGER:
-            LOG(fprintf(stderr, "REGISTER COHERENT SEGMENT: %16lx\n", addr.op_argument);
-                fflush(stderr));
-            command = COHERENCE_OP_ADD;
-            break;
-          case data_server_op::RELEASE_COHERENCE_BARRIER:
-            LOG(std::cerr << "RELEASE COHERENCE BARRIER" << std::endl);
-            command = COHERENCE_OP_BARRIER_RELEASE;
-            break;
-        }
-        command |= (id & 0xFFFF) << 2;
-
-        while (!peek_mmio(COHERENCE_READY)) {}
-        poke_mmio(COHERENCE_BITS, command);
-        poke_mmio(COHERENCE_VALID, 1);
-        pthread_mutex_unlock(&bus_lock);
-        addr.resp_id = id;
-
-        break;
-      }
-#endif
-#else
-#error("Doesn't appear that we're covering all cases inside data server")
-#endif
+    uint64_t args[3] = {addr.op_argument, addr.op2_argument, addr.op3_argument};
+    int rc = run_op(addr.operation, args, addr.fname, addr.resp_id);
+    if (rc != 0) {
+      // The legacy response has no status field. Zeroed arguments are what a failed ALLOC hands back (a null device
+      // address), so that's the one answer a client can check for whatever the op was
+      std::cerr << "Data server op " << addr.operation << " (" << std::hex << addr.op_argument << ", "
+                << addr.op2_argument << ", " << std::dec << addr.op3_argument << ") failed: " << strerror(rc)
+                << std::endl;
+      std::fill(std::begin(args), std::end(args), 0);
     }
+    addr.op_argument = args[0];
+    addr.op2_argument = args[1];
+    addr.op3_argument = args[2];
+    pthread_rwlock_unlock(&data_server_busy);
     // un-lock client to read response
     pthread_mutex_unlock(&addr.data_cmd_recieve_resp_lock);
     // re-lock self to stall
@@ -385,74 +780,207 @@ data_server_file *dsf;
   }
 }
 
-void data_server::start() {
-  pthread_t thread;
-  pthread_create(&thread, nullptr, data_server_f, nullptr);
+struct ring_worker {
+  data_ring_file *ring;
+  data_ring_file::queue_id queue;
+};
+
+[[noreturn]] static void *data_ring_worker_f(void *arg) {
+  affinity::pin_runtime_thread();
+  auto w = *(ring_worker *) arg;
+  delete (ring_worker *) arg;
+  auto &queue = w.ring->queues[w.queue];
+  while (true) {
+    auto t = queue.pop();
+    auto &tok = w.ring->tokens[t];
+    int resp_id = 0;
+    pthread_rwlock_rdlock(&data_server_busy);
+    tok.status = run_op(tok.op, tok.arg, tok.fname, resp_id);
+    pthread_rwlock_unlock(&data_server_busy);
+    w.ring->complete(t);
+  }
 }
 
-void *address_translator::translate(uint64_t fp_addr) const {
-  auto it = mappings.begin();
-  while (it != mappings.end()) {
-    if (it->fpga_addr <= fp_addr and it->fpga_addr + it->mapping_length > fp_addr) {
-      break;
+// Take file descriptors that clients pass us (with SCM_RIGHTS) for REGISTER_BUFFER, and answer each with a cookie to
+// name it by. A client can only ever hand us files that it holds open itself, which is why registration doesn't take
+// a path
+[[noreturn]] static void *fd_receiver_f(void *arg) {
+  int sock = (int) (intptr_t) arg;
+  while (true) {
+    int conn = accept(sock, nullptr, nullptr);
+    if (conn < 0) continue;
+    // a client that connects and then sends nothing mustn't hold up everyone else's registrations
+    timeval timeout{1, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char byte;
+    iovec iov{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    uint64_t cookie = 0;
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) > 0) {
+      auto c = CMSG_FIRSTHDR(&msg);
+      if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(int))) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(c), sizeof(int));
+        cookie = keep_passed_fd(fd);
+        if (cookie == 0) close(fd);
+      }
     }
-    it++;
+    if (send(conn, &cookie, sizeof(cookie), MSG_NOSIGNAL) != sizeof(cookie)) take_passed_fd(cookie);
+    close(conn);
   }
-  if (it == mappings.end()) {
-    std::cerr << "BAD ADDRESS IN TRANSLATION FROM FPGA -> CPU: " << std::hex << fp_addr << ". You might be running outside of your allocated segment... " << std::endl;
-    std::cerr << "Existing Mappings:" << std::endl;
-    for (auto q: mappings) {
-      std::cerr << q.fpga_addr << "\t" << q.mapping_length << std::endl;
-    }
-#if defined(SIM) && defined(TRACE)
-    tfp->close();
-#endif
-#if defined(SIM) && !defined(USE_VERILATOR)
-    vpi_control(vpiFinish);
-    return nullptr;
-#else
+}
+
+static void start_fd_receiver() {
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  auto addr = data_ring::fd_socket_address(shm_instance_suffix);
+  if (sock < 0 || bind(sock, (sockaddr *) &addr.first, addr.second) || listen(sock, 16)) {
+    std::cerr << "Failed to set up the buffer registration socket, REGISTER_BUFFER won't work: " << strerror(errno)
+              << std::endl;
+    if (sock >= 0) close(sock);
+    return;
+  }
+  pthread_t thread;
+  pthread_create(&thread, nullptr, fd_receiver_f, (void *) (intptr_t) sock);
+}
+
+static data_ring_file *open_data_ring() {
+  auto name = data_ring_file_name(shm_instance_suffix);
+  int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, file_access_flags);
+  if (fd < 0 || ftruncate(fd, sizeof(data_ring_file))) {
+    std::cerr << "Failed to set up data ring '" << name << "': " << strerror(errno) << std::endl;
     throw std::exception();
-#endif
   }
-  if (it->fpga_addr + it->mapping_length <= fp_addr) {
-    std::cerr << "ADDRESS IS OUT OF BOUNDS FROM FPGA -> CPU\n"
-              << std::endl;
-#if defined(SIM) && defined(USE_VCS)
-      vpi_control(vpiFinish);
-#endif
+  void *mapped = mmap(nullptr, sizeof(data_ring_file), file_access_prots, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    std::cerr << "Failed to map data ring: " << strerror(errno) << std::endl;
     throw std::exception();
   }
-  return (char *) it->cpu_addr + (fp_addr - it->fpga_addr);
+  auto ring = (data_ring_file *) mapped;
+  data_ring_file::init(*ring);
+  return ring;
+}
+
+void data_server::start() {
+  srand(time(nullptr));// NOLINT(cert-msc51-cpp)
+#ifdef BEETHOVEN_USE_CUSTOM_ALLOC
+  if (allocator == nullptr) {
+    LOG(std::cerr << "Constructing allocator" << std::endl);
+    allocator = new device_allocator<ALLOCATOR_SIZE_BYTES>();
+    LOG(std::cerr << "Allocator constructed - data server ready" << std::endl);
+  }
+#endif
+  pthread_t thread;
+  pthread_create(&thread, nullptr, data_server_f, nullptr);
+
+  auto ring = open_data_ring();
+  start_fd_receiver();
+  int n_movers = 2;
+  if (const char *v = getenv("BEETHOVEN_DATA_WORKERS")) n_movers = std::max(1, atoi(v));
+  pthread_create(&thread, nullptr, data_ring_worker_f, new ring_worker{ring, data_ring_file::QUEUE_MANAGE});
+  for (int i = 0; i < n_movers; ++i) {
+    pthread_create(&thread, nullptr, data_ring_worker_f, new ring_worker{ring, data_ring_file::QUEUE_MOVE});
+  }
 }
 
-void address_translator::add_mapping(uint64_t fpga_addr, uint64_t mapping_length, void *cpu_addr) {
-  mappings.emplace(fpga_addr, cpu_addr, mapping_length);
+// The name a sweep child gives its own copy of the segment `name`
+static std::string sweep_copy_name(const std::string &name) {
+  return name + shm_instance_suffix;
 }
 
-void address_translator::remove_mapping(uint64_t fpga_addr) {
-  addr_pair a(fpga_addr, nullptr, 0);
-  auto it = mappings.find(a);
-  if (it == mappings.end()) {
-    std::cerr << "ERROR - could not remove mapping in data server because could not find address...\n"
-              << std::endl;
+// Replace the `len` bytes at `cpu_addr` with a shared mapping of the same bytes at `offset` in the segment `copy_name`,
+// copying them over first. `file_size` is what the segment should be truncated to if we're the first to create it
+static void move_to_copy(void *cpu_addr, uint64_t len, const std::string &copy_name, uint64_t offset,
+                         uint64_t file_size) {
+  int fd = shm_arena::open_segment(copy_name, O_CREAT | O_RDWR);
+  if (fd < 0) {
+    std::cerr << "Failed to create sweep copy '" << copy_name << "': " << strerror(errno) << std::endl;
+    throw std::exception();
+  }
+  struct stat st{};
+  if (fstat(fd, &st) || (uint64_t(st.st_size) < file_size && ftruncate(fd, (off_t) file_size))) {
+    std::cerr << "Failed to size sweep copy '" << copy_name << "': " << strerror(errno) << std::endl;
+    throw std::exception();
+  }
+  void *copy = mmap(nullptr, len, file_access_prots, MAP_SHARED, fd, (off_t) offset);
+  close(fd);
+  if (copy == MAP_FAILED) {
+    std::cerr << "Failed to map sweep copy '" << copy_name << "': " << strerror(errno) << std::endl;
+    throw std::exception();
+  }
+  memcpy(copy, cpu_addr, len);
+  // same address, so every pointer into the allocation stays valid, but it's now backed by our own copy
+  if (mremap(copy, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, cpu_addr) == MAP_FAILED) {
+    std::cerr << "Failed to move sweep copy '" << copy_name << "' into place: " << strerror(errno) << std::endl;
     throw std::exception();
   }
-  mappings.erase(it);
 }
 
-std::pair<void *, uint64_t> address_translator::get_mapping(uint64_t fpga_addr) const {
-  auto it = mappings.begin();
-  while (it != mappings.end()) {
-    if (it->fpga_addr == fpga_addr) {
-      return std::make_pair(it->cpu_addr, it->mapping_length);
+static void unlink_sweep_copies() {
+  for (const auto &name: sweep_copies) {
+    if (name.find('/', 1) != std::string::npos) unlink(name.c_str());
+    else shm_unlink(name.c_str());
+  }
+}
+
+void data_server::copy_allocations_for_sweep() {
+  // the copies are ours alone, nobody else is going to clean them up
+  atexit(unlink_sweep_copies);
+  auto manifest_name = "allocations" + shm_instance_suffix + ".txt";
+  FILE *manifest = fopen(manifest_name.c_str(), "w");
+  for (const auto &m: at.mappings) {
+    std::string name, copy_name;
+    uint64_t offset = 0, file_size;
+    auto reg = registered.find((uint64_t) m.cpu_addr);
+    if (reg != registered.end()) {
+      // a registered buffer is the client's file, it gets a segment of its own from here on
+      copy_name = sweep_copy_name("/beethoven_registered_" + std::to_string(m.fpga_addr));
+      file_size = m.mapping_length;
+      move_to_copy(m.cpu_addr, m.mapping_length, copy_name, 0, file_size);
+      close(reg->second.fd);
+      registered.erase(reg);
+    } else {
+      if (!shm_arena::lookup(m.cpu_addr, name, offset)) {
+        auto it = alloc_names.find((uint64_t) m.cpu_addr);
+        if (it == alloc_names.end()) {
+          std::cerr << "No backing segment recorded for allocation at " << std::hex << m.fpga_addr << std::endl;
+          throw std::exception();
+        }
+        name = it->second;
+      }
+      int fd = shm_arena::open_segment(name, O_RDONLY);
+      struct stat st{};
+      if (fd < 0 || fstat(fd, &st)) {
+        std::cerr << "Failed to reopen shared memory segment '" << name << "': " << strerror(errno) << std::endl;
+        throw std::exception();
+      }
+      close(fd);
+      // allocations that share an arena share its copy too, at the same offsets
+      copy_name = sweep_copy_name(name);
+      file_size = st.st_size;
+      move_to_copy(m.cpu_addr, m.mapping_length, copy_name, offset, file_size);
+    }
+    if (!shm_arena::lookup(m.cpu_addr, name, offset)) alloc_names[(uint64_t) m.cpu_addr] = copy_name;
+    sweep_copies.insert(copy_name);
+    if (manifest) {
+      fprintf(manifest, "%lx %lu %s %lu %lu\n", (unsigned long) m.fpga_addr, (unsigned long) m.mapping_length,
+              copy_name.c_str(), (unsigned long) offset, (unsigned long) file_size);
     }
-    it++;
   }
-  std::cerr << "Mapping not found!" << std::endl;
-  throw std::exception();
+  if (manifest) fclose(manifest);
+  // new allocations must not come out of (or punch holes in) the arenas that we share with the parent
+  shm_arena::detach();
 }
 
 data_server::~data_server() {
+  shm_arena::unlink_all();
   munmap(&dsf, sizeof(data_server_file));
-  shm_unlink(data_server_file_name().c_str());
+  shm_unlink(data_file_name().c_str());
+  shm_unlink(data_ring_file_name(shm_instance_suffix).c_str());
+  unlink_sweep_copies();
 }
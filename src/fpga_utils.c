@@ -17,6 +17,9 @@ pthread_mutex_t bus_lock;
 int pci_bar_handle;
 int xdma_write_fd;
 int xdma_read_fd;
+int xdma_n_channels = 1;
+int xdma_write_fds[XDMA_MAX_CHANNELS];
+int xdma_read_fds[XDMA_MAX_CHANNELS];
 
 
 void check_rc(int rc, const char *message) {
@@ -54,16 +57,24 @@ void fpga_setup(int slot_id) {
 
 #if USE_XDMA
 
-  xdma_read_fd = fpga_dma_open_queue(FPGA_DMA_XDMA, slot_id, 0, true);
-  if (xdma_read_fd < 0) {
-    fprintf(stderr, "Error opening XDMA read fd\n");
-    exit(1);
-  }
-  xdma_write_fd = fpga_dma_open_queue(FPGA_DMA_XDMA, slot_id, 0, false);
-  if (xdma_write_fd < 0) {
-    fprintf(stderr, "Error opening XDMA write fd\n");
-    exit(1);
+  const char *channels = getenv("BEETHOVEN_XDMA_CHANNELS");
+  xdma_n_channels = channels ? atoi(channels) : XDMA_MAX_CHANNELS;
+  if (xdma_n_channels < 1) xdma_n_channels = 1;
+  if (xdma_n_channels > XDMA_MAX_CHANNELS) xdma_n_channels = XDMA_MAX_CHANNELS;
+  for (int ch = 0; ch < xdma_n_channels; ++ch) {
+    xdma_read_fds[ch] = fpga_dma_open_queue(FPGA_DMA_XDMA, slot_id, ch, true);
+    if (xdma_read_fds[ch] < 0) {
+      fprintf(stderr, "Error opening XDMA read fd for channel %d\n", ch);
+      exit(1);
+    }
+    xdma_write_fds[ch] = fpga_dma_open_queue(FPGA_DMA_XDMA, slot_id, ch, false);
+    if (xdma_write_fds[ch] < 0) {
+      fprintf(stderr, "Error opening XDMA write fd for channel %d\n", ch);
+      exit(1);
+    }
   }
+  xdma_read_fd = xdma_read_fds[0];
+  xdma_write_fd = xdma_write_fds[0];
 #endif
 #endif
 }
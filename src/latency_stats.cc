@@ -0,0 +1,123 @@
+#include "latency_stats.h"
+#include <algorithm>
+#include <atomic>
+#include <beethoven/verilator_server.h>
+
+namespace {
+  const int n_buckets = 40;
+
+  struct histogram {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+    // bucket b counts samples in [2^(b-1), 2^b) ns, bucket 0 is everything under 1ns
+    std::atomic<uint64_t> buckets[n_buckets]{};
+
+    void add(uint64_t ns) {
+      count.fetch_add(1, std::memory_order_relaxed);
+      total_ns.fetch_add(ns, std::memory_order_relaxed);
+      auto seen = max_ns.load(std::memory_order_relaxed);
+      while (ns > seen && !max_ns.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {}
+      int b = 0;
+      for (uint64_t v = ns; v > 0 && b < n_buckets - 1; v >>= 1) b++;
+      buckets[b].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // upper bound of the bucket that the q-th quantile falls in (but never more than the largest sample)
+    [[nodiscard]] uint64_t quantile_ns(double q) const {
+      auto n = count.load(std::memory_order_relaxed);
+      auto largest = max_ns.load(std::memory_order_relaxed);
+      auto target = uint64_t(q * double(n));
+      uint64_t seen = 0;
+      for (int b = 0; b < n_buckets; ++b) {
+        seen += buckets[b].load(std::memory_order_relaxed);
+        if (seen > target) return std::min<uint64_t>(largest, b == 0 ? 1 : 1ull << b);
+      }
+      return largest;
+    }
+  };
+
+  histogram stages[latency_stats::N_STAGES];
+
+  const char *stage_names[latency_stats::N_STAGES] = {
+          "cmdserverlock wait",
+          "bus lock wait",
+          "MMIO push",
+          "hardware",
+          "poll detection",
+          "response read",
+          "register_reponse",
+          "end to end",
+  };
+
+  const int n_handles = sizeof(beethoven::cmd_server_file::responses) / sizeof(beethoven::rocc_response);
+  // written by the command server, read by whoever registers the response
+  std::atomic<uint64_t> received_at[n_handles];
+  std::atomic<uint64_t> delivered_at[n_handles];
+
+  thread_local struct {
+    bool valid = false;
+    uint64_t looking_since, last_miss, detected;
+  } seen;
+
+  void print_ns(FILE *f, double ns) {
+    if (ns < 1e3) fprintf(f, " %9.0fns", ns);
+    else if (ns < 1e6) fprintf(f, " %9.2fus", ns / 1e3);
+    else fprintf(f, " %9.2fms", ns / 1e6);
+  }
+}
+
+void latency_stats::record(stage s, uint64_t ns) {
+  stages[s].add(ns);
+}
+
+void latency_stats::command_received(int id, uint64_t t_ns) {
+  if (id < 0 || id >= n_handles) return;
+  received_at[id].store(t_ns, std::memory_order_relaxed);
+  delivered_at[id].store(0, std::memory_order_relaxed);
+}
+
+void latency_stats::command_delivered(int id, uint64_t t_ns) {
+  if (id < 0 || id >= n_handles) return;
+  delivered_at[id].store(t_ns, std::memory_order_relaxed);
+}
+
+void latency_stats::response_seen(uint64_t looking_since, uint64_t last_miss, uint64_t detected) {
+  seen.valid = true;
+  seen.looking_since = looking_since;
+  seen.last_miss = last_miss;
+  seen.detected = detected;
+}
+
+void latency_stats::response_routed(int id, uint64_t start) {
+  auto now = now_ns();
+  record(STAGE_REGISTER, now - start);
+  if (id < 0 || id >= n_handles) return;
+  auto received = received_at[id].load(std::memory_order_relaxed);
+  if (received && received <= now) record(STAGE_END_TO_END, now - received);
+  if (!seen.valid) return;
+  seen.valid = false;
+  // the poller can see a response before the command server gets around to stamping its delivery. Skip those
+  auto delivered = delivered_at[id].load(std::memory_order_relaxed);
+  if (delivered == 0 || delivered > seen.detected) return;
+  auto appeared = std::max(delivered, seen.last_miss ? seen.last_miss : seen.looking_since);
+  appeared = std::min(appeared, seen.detected);
+  record(STAGE_HW_EXEC, appeared - delivered);
+  record(STAGE_POLL_DETECT, seen.detected - appeared);
+}
+
+void latency_stats::report(FILE *f) {
+  fprintf(f, "[latency] %-20s %8s %11s %11s %11s %11s\n", "stage", "count", "avg", "p50", "p99", "max");
+  for (int s = 0; s < N_STAGES; ++s) {
+    auto &h = stages[s];
+    auto n = h.count.load(std::memory_order_relaxed);
+    if (n == 0) continue;
+    fprintf(f, "[latency] %-20s %8lu", stage_names[s], (unsigned long) n);
+    print_ns(f, double(h.total_ns.load(std::memory_order_relaxed)) / double(n));
+    print_ns(f, double(h.quantile_ns(0.5)));
+    print_ns(f, double(h.quantile_ns(0.99)));
+    print_ns(f, double(h.max_ns.load(std::memory_order_relaxed)));
+    fprintf(f, "\n");
+  }
+  fflush(f);
+}
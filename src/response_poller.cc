@@ -10,40 +10,200 @@
 #endif
 
 #include "cmd_server.h"
+#include "affinity.h"
+#include "latency_stats.h"
+#include <algorithm>
+#include <atomic>
 #include <beethoven_hardware.h>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+#include <ctime>
 #include <thread>
 #include "util.h"
 
 using namespace std::chrono_literals;
 
+namespace {
+  // tuning knobs, see response_poller.h
+  uint32_t spin_peeks = 64;
+  uint32_t min_backoff_us = 1;
+  uint32_t max_backoff_us = 128;
+
+  // how long it took from a response showing up (right after the last empty peek, see latency_stats.h) to having read
+  // it, in log2(us) buckets
+  const int n_latency_buckets = 24;
+  // only the poll thread writes these, but the reporter thread reads them whenever it's asked to
+  struct {
+    std::atomic<uint64_t> responses{0};
+    std::atomic<uint64_t> wakeups{0};
+    std::atomic<uint64_t> peeks{0};
+    std::atomic<uint64_t> sleeps{0};
+    std::atomic<uint64_t> latency_total_ns{0};
+    std::atomic<uint64_t> latency_max_ns{0};
+    std::atomic<uint64_t> latency_hist[n_latency_buckets]{};
+  } stats;
+
+  void bump(std::atomic<uint64_t> &counter, uint64_t by = 1) {
+    counter.fetch_add(by, std::memory_order_relaxed);
+  }
+
+  uint64_t read(const std::atomic<uint64_t> &counter) {
+    return counter.load(std::memory_order_relaxed);
+  }
+  std::chrono::steady_clock::time_point poller_start;
+
+  uint32_t env_or(const char *name, uint32_t dflt) {
+    const char *v = getenv(name);
+    return v ? (uint32_t) strtoul(v, nullptr, 10) : dflt;
+  }
+
+  double thread_cpu_seconds(clockid_t clock) {
+    timespec ts{};
+    clock_gettime(clock, &ts);
+    return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+  }
+
+  clockid_t poller_cpu_clock;
+  // set by the poll thread once poller_cpu_clock is valid
+  std::atomic<bool> have_cpu_clock(false);
+
+  // Wait until the hardware has a response for us: spin for a bit, then back off exponentially. Returns with bus_lock
+  // held, and the time of the last peek that came back empty (0 if there wasn't one) in `last_miss`
+  void wait_for_response(uint64_t &last_miss) {
+    uint32_t backoff_us = min_backoff_us;
+    uint32_t spins = 0;
+    last_miss = 0;
+    while (true) {
+      pthread_mutex_lock(&bus_lock);
+      bump(stats.peeks);
+      if (peek_mmio(RESP_VALID)) return;
+      last_miss = latency_stats::now_ns();
+      pthread_mutex_unlock(&bus_lock);
+      if (spins < spin_peeks) {
+        spins++;
+        continue;
+      }
+      bump(stats.sleeps);
+      std::this_thread::sleep_for(std::chrono::microseconds(backoff_us));
+      backoff_us = std::min(backoff_us * 2, max_backoff_us);
+    }
+  }
+
+  void record_latency(uint64_t since_ns) {
+    auto now = latency_stats::now_ns();
+    auto ns = now > since_ns ? now - since_ns : 0;
+    bump(stats.responses);
+    bump(stats.latency_total_ns, ns);
+    if (ns > read(stats.latency_max_ns)) stats.latency_max_ns.store(ns, std::memory_order_relaxed);
+    int bucket = 0;
+    for (uint64_t us = ns / 1000; us > 0 && bucket < n_latency_buckets - 1; us >>= 1) bucket++;
+    bump(stats.latency_hist[bucket]);
+  }
+}
+
 [[noreturn]] static void* poll_thread(void *in) {
   auto sem = (sem_t *) in;
+  affinity::pin_runtime_thread();
+  if (pthread_getcpuclockid(pthread_self(), &poller_cpu_clock) == 0) {
+    have_cpu_clock.store(true, std::memory_order_release);
+  }
   while (true) {
     sem_wait(sem);
-    uint32_t buf[3];
-    for (unsigned int &i: buf) {
-      uint32_t resp_ready = 0;
-      while (!resp_ready) {
-        pthread_mutex_lock(&bus_lock);
-        resp_ready = peek_mmio(RESP_VALID);
-        pthread_mutex_unlock(&bus_lock);
-        if (not resp_ready) {
-          std::this_thread::sleep_for(10us);
+    bump(stats.wakeups);
+    // every post on the semaphore is one response we're owed. Drain as many as are owed without going back to sleep
+    do {
+      auto looking_since = latency_stats::now_ns();
+      uint64_t last_miss;
+      uint32_t buf[3];
+      wait_for_response(last_miss);
+      auto detected = latency_stats::now_ns();
+      // the rest of the response follows right behind the first word, so hold the bus for all of it
+      for (int w = 0; w < 3; ++w) {
+        if (w > 0) {
+          while (!peek_mmio(RESP_VALID)) {}
         }
+        buf[w] = peek_mmio(RESP_BITS);
+        poke_mmio(RESP_READY, 1);
       }
-      pthread_mutex_lock(&bus_lock);
-      i = peek_mmio(RESP_BITS);
-      poke_mmio(RESP_READY, 1);
       pthread_mutex_unlock(&bus_lock);
+      latency_stats::record(latency_stats::STAGE_RESP_READ, latency_stats::now_ns() - detected);
+      latency_stats::response_seen(looking_since, last_miss, detected);
+      LOG(std::cerr << "Got response buffer" << std::endl);
+      register_reponse(buf);
+      LOG(std::cerr << "Successfully enqueued response" << std::endl);
+      record_latency(last_miss ? last_miss : looking_since);
+    } while (sem_trywait(sem) == 0);
+  }
+}
 
+void response_poller::report(FILE *f) {
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - poller_start).count();
+  auto responses = read(stats.responses);
+  fprintf(f, "[poller] %lu responses in %lu wakeups, %lu peeks, %lu sleeps\n", (unsigned long) responses,
+          (unsigned long) read(stats.wakeups), (unsigned long) read(stats.peeks), (unsigned long) read(stats.sleeps));
+  if (have_cpu_clock.load(std::memory_order_acquire) && wall > 0) {
+    fprintf(f, "[poller] cpu %.3fs over %.3fs wall (%.1f%%)\n", thread_cpu_seconds(poller_cpu_clock), wall,
+            100.0 * thread_cpu_seconds(poller_cpu_clock) / wall);
+  }
+  if (responses) {
+    fprintf(f, "[poller] latency avg %.2fus max %.2fus\n",
+            double(read(stats.latency_total_ns)) / 1e3 / double(responses), double(read(stats.latency_max_ns)) / 1e3);
+    for (int i = 0; i < n_latency_buckets; ++i) {
+      auto n = read(stats.latency_hist[i]);
+      if (n == 0) continue;
+      fprintf(f, "[poller]   < %8luus: %lu\n", 1ul << i, (unsigned long) n);
     }
-    LOG(std::cerr << "Got response buffer" << std::endl);
-    register_reponse(buf);
-    LOG(std::cerr << "Successfully enqueued response" << std::endl);
   }
+  fflush(f);
+}
+
+// The signal handler only posts a semaphore (which is async-signal-safe), the printing happens on a thread of its own
+static sem_t report_sem;
+
+static void report_on_signal(int) {
+  sem_post(&report_sem);
+}
+
+[[noreturn]] static void *report_thread(void *) {
+  while (true) {
+    if (sem_wait(&report_sem) != 0) continue;
+    response_poller::report(stderr);
+    latency_stats::report(stderr);
+  }
+}
+
+static void install_report_signal() {
+  int signo = (int) env_or("BEETHOVEN_STATS_SIGNAL", SIGUSR1);
+  if (signo == 0) return;
+  struct sigaction sa{}, old{};
+  sa.sa_handler = report_on_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(signo, nullptr, &old) != 0) {
+    std::cerr << "Warning: BEETHOVEN_STATS_SIGNAL=" << signo << " is not a valid signal, statistics reporting is off"
+              << std::endl;
+    return;
+  }
+  // don't take the signal away from whoever else in the process already handles it
+  if (old.sa_handler != SIG_DFL || (old.sa_flags & SA_SIGINFO)) {
+    std::cerr << "Warning: signal " << signo << " already has a handler, statistics reporting is off. Pick another "
+                 "one with BEETHOVEN_STATS_SIGNAL" << std::endl;
+    return;
+  }
+  sem_init(&report_sem, 0, 0);
+  pthread_t thread;
+  pthread_create(&thread, nullptr, report_thread, nullptr);
+  sigaction(signo, &sa, nullptr);
 }
 
 void response_poller::start_poller(sem_t *t) {
+  spin_peeks = env_or("BEETHOVEN_POLL_SPIN", spin_peeks);
+  min_backoff_us = std::max(1u, env_or("BEETHOVEN_POLL_MIN_US", min_backoff_us));
+  max_backoff_us = std::max(min_backoff_us, env_or("BEETHOVEN_POLL_MAX_US", max_backoff_us));
+  poller_start = std::chrono::steady_clock::now();
+  install_report_signal();
   pthread_t thread;
   pthread_create(&thread, nullptr, poll_thread, (void *) t);
 }
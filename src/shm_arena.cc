@@ -0,0 +1,242 @@
+#include "shm_arena.h"
+#include "util.h"
+#include <algorithm>
+#include <beethoven/verilator_server.h>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <vector>
+
+namespace {
+  struct arena {
+    std::string name;
+    char *base;
+    uint64_t size;
+    int fd;
+    shm_arena::page_kind kind;
+    // offset -> length of every free extent, and the same extents ordered by size for best-fit
+    std::map<uint64_t, uint64_t> free_by_offset;
+    std::set<std::pair<uint64_t, uint64_t>> free_by_size;
+    // offset -> length of every live allocation
+    std::map<uint64_t, uint64_t> live;
+
+    void insert_free(uint64_t off, uint64_t len) {
+      free_by_offset[off] = len;
+      free_by_size.emplace(len, off);
+    }
+
+    void erase_free(std::map<uint64_t, uint64_t>::iterator it) {
+      free_by_size.erase({it->second, it->first});
+      free_by_offset.erase(it);
+    }
+  };
+
+  // not thread-safe by themselves. The data server's worker threads only get here through ALLOC and FREE, which hold
+  // alloc_lock in data_server.cc. The sweep code gets here in a freshly forked child, before the server threads are back
+  std::vector<arena *> arenas;
+  std::vector<arena *> detached;
+
+  uint64_t round_up(uint64_t n, uint64_t to = shm_arena::granule) {
+    return (n + to - 1) / to * to;
+  }
+
+  uint64_t granule_of(shm_arena::page_kind kind) {
+    return kind == shm_arena::PAGES_SMALL ? shm_arena::granule : shm_arena::huge_page_bytes;
+  }
+
+  // set once hugetlbfs has failed us, so that we don't keep trying (and warning) for every arena
+  bool hugetlb_unavailable = false;
+
+  // An arena in the hugetlbfs mount. Huge pages are reserved when the file is mapped, so this fails up front (instead
+  // of with a SIGBUS later) if there aren't enough of them
+  bool open_hugetlb(arena *a) {
+    const char *dir = getenv("BEETHOVEN_HUGETLBFS");
+    a->name = std::string(dir ? dir : "/dev/hugepages") + "/beethoven_arena_" +
+              std::to_string(rand());// NOLINT(cert-msc50-cpp)
+    // the file holds on to its huge pages until it's unlinked, even after we're gone
+    static const int unlink_at_exit = atexit(shm_arena::unlink_all);
+    (void) unlink_at_exit;
+    a->fd = open(a->name.c_str(), O_CREAT | O_RDWR, beethoven::file_access_flags);
+    if (a->fd < 0) {
+      std::cerr << "Failed to create '" << a->name << "' for a huge page arena: " << strerror(errno) << std::endl;
+      return false;
+    }
+    void *base = MAP_FAILED;
+    if (ftruncate(a->fd, (off_t) a->size) == 0) {
+      base = mmap(nullptr, a->size, beethoven::file_access_prots, MAP_SHARED, a->fd, 0);
+    }
+    if (base == MAP_FAILED) {
+      std::cerr << "Failed to get " << a->size / shm_arena::huge_page_bytes << " huge pages for an arena ("
+                << strerror(errno) << "). Is vm.nr_hugepages large enough?" << std::endl;
+      close(a->fd);
+      unlink(a->name.c_str());
+      return false;
+    }
+    a->base = (char *) base;
+    return true;
+  }
+
+  arena *open_arena(uint64_t size, shm_arena::page_kind kind) {
+    auto a = new arena;
+    a->size = round_up(size, granule_of(kind));
+    a->kind = kind;
+    if (kind == shm_arena::PAGES_HUGETLB && !hugetlb_unavailable && open_hugetlb(a)) {
+      a->insert_free(0, a->size);
+      arenas.push_back(a);
+      return a;
+    }
+    if (kind == shm_arena::PAGES_HUGETLB) {
+      if (!hugetlb_unavailable) std::cerr << "Falling back to transparent huge pages" << std::endl;
+      hugetlb_unavailable = true;
+      a->kind = shm_arena::PAGES_THP;
+    }
+
+    a->name = "/beethoven_arena_" + std::to_string(rand());// NOLINT(cert-msc50-cpp)
+    a->fd = shm_open(a->name.c_str(), O_CREAT | O_RDWR, beethoven::file_access_flags);
+    if (a->fd < 0) {
+      std::cerr << "Failed to open shared memory arena: " << strerror(errno) << std::endl;
+      throw std::exception();
+    }
+    // sparse, so a large arena costs nothing until its pages are touched
+    if (ftruncate(a->fd, (off_t) a->size)) {
+      std::cerr << "Failed to size shared memory arena to " << a->size << "B: " << strerror(errno) << std::endl;
+      throw std::exception();
+    }
+    void *base = shm_arena::map_segment(a->fd, a->size, a->kind);
+    if (base == MAP_FAILED) {
+      std::cerr << "Failed to map shared memory arena: " << strerror(errno) << std::endl;
+      throw std::exception();
+    }
+    a->base = (char *) base;
+    a->insert_free(0, a->size);
+    arenas.push_back(a);
+    LOG(std::cerr << "Opened arena " << a->name << " of " << a->size << "B" << std::endl);
+    return a;
+  }
+
+  arena *owner_of(const std::vector<arena *> &v, void *cpu_addr) {
+    for (auto a: v) {
+      if ((char *) cpu_addr >= a->base && (char *) cpu_addr < a->base + a->size) return a;
+    }
+    return nullptr;
+  }
+}
+
+uint64_t shm_arena::arena_bytes() {
+  static uint64_t bytes = [] {
+    const char *v = getenv("BEETHOVEN_SHM_ARENA");
+    return v ? round_up(strtoull(v, nullptr, 10) << 20) : 0;
+  }();
+  return bytes;
+}
+
+shm_arena::page_kind shm_arena::requested_pages() {
+  static page_kind kind = [] {
+    const char *v = getenv("BEETHOVEN_HUGEPAGES");
+    if (v == nullptr || !strcmp(v, "off")) return PAGES_SMALL;
+    if (!strcmp(v, "thp")) return PAGES_THP;
+    if (!strcmp(v, "hugetlb")) return PAGES_HUGETLB;
+    std::cerr << "Unrecognized BEETHOVEN_HUGEPAGES '" << v << "'. Expected off, thp or hugetlb" << std::endl;
+    throw std::exception();
+  }();
+  return kind;
+}
+
+void *shm_arena::map_segment(int fd, uint64_t size, page_kind kind) {
+  if (kind == PAGES_SMALL) return mmap(nullptr, size, beethoven::file_access_prots, MAP_SHARED, fd, 0);
+  // a huge page can only be mapped at a 2MB-aligned address, so reserve a bit more and place the mapping inside it
+  auto reserved = size + huge_page_bytes;
+  auto region = (char *) mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED) return MAP_FAILED;
+  auto aligned = (char *) round_up((uint64_t) region, huge_page_bytes);
+  void *base = mmap(aligned, size, beethoven::file_access_prots, MAP_SHARED | MAP_FIXED, fd, 0);
+  if (base == MAP_FAILED) {
+    munmap(region, reserved);
+    return MAP_FAILED;
+  }
+  if (aligned > region) munmap(region, aligned - region);
+  munmap(aligned + size, region + reserved - (aligned + size));
+  // best effort, the kernel may not do huge pages for shmem at all
+  madvise(base, size, MADV_HUGEPAGE);
+  return base;
+}
+
+shm_arena::allocation shm_arena::alloc(uint64_t nBytes) {
+  auto kind = nBytes >= huge_page_bytes ? requested_pages() : PAGES_SMALL;
+  auto len = round_up(std::max<uint64_t>(nBytes, 1), granule_of(kind));
+  for (auto a: arenas) {
+    // hugetlb arenas that fell back to thp still serve requests for hugetlb
+    if (a->kind != kind && !(a->kind == PAGES_THP && kind == PAGES_HUGETLB && hugetlb_unavailable)) continue;
+    auto fit = a->free_by_size.lower_bound({len, 0});
+    if (fit == a->free_by_size.end()) continue;
+    auto off = fit->second;
+    auto extent = fit->first;
+    a->erase_free(a->free_by_offset.find(off));
+    if (extent > len) a->insert_free(off + len, extent - len);
+    a->live[off] = len;
+    return {a->name, off, a->size, a->base + off};
+  }
+  auto a = open_arena(std::max(arena_bytes(), len), kind);
+  a->erase_free(a->free_by_offset.begin());
+  if (a->size > len) a->insert_free(len, a->size - len);
+  a->live[0] = len;
+  return {a->name, 0, a->size, a->base};
+}
+
+bool shm_arena::free(void *cpu_addr) {
+  // a detached arena belongs to a sweep parent, and our allocations in it have moved to our own copy of it. Just leave
+  // the memory be
+  if (owner_of(detached, cpu_addr)) return true;
+  auto a = owner_of(arenas, cpu_addr);
+  if (a == nullptr) return false;
+  auto off = uint64_t((char *) cpu_addr - a->base);
+  auto it = a->live.find(off);
+  if (it == a->live.end()) return false;
+  auto len = it->second;
+  a->live.erase(it);
+
+  // hand the pages back. Whoever gets them next reads zeros without anyone having to clear them
+  if (fallocate(a->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) off, (off_t) len)) {
+    memset(a->base + off, 0, len);
+  }
+
+  // coalesce with the neighbouring free extents
+  auto next = a->free_by_offset.lower_bound(off);
+  if (next != a->free_by_offset.end() && next->first == off + len) {
+    len += next->second;
+    a->erase_free(next);
+  }
+  auto prev = a->free_by_offset.lower_bound(off);
+  if (prev != a->free_by_offset.begin()) {
+    --prev;
+    if (prev->first + prev->second == off) {
+      off = prev->first;
+      len += prev->second;
+      a->erase_free(prev);
+    }
+  }
+  a->insert_free(off, len);
+  return true;
+}
+
+bool shm_arena::lookup(void *cpu_addr, std::string &name, uint64_t &offset) {
+  auto a = owner_of(arenas, cpu_addr);
+  if (a == nullptr) a = owner_of(detached, cpu_addr);
+  if (a == nullptr) return false;
+  name = a->name;
+  offset = uint64_t((char *) cpu_addr - a->base);
+  return true;
+}
+
+void shm_arena::detach() {
+  detached.insert(detached.end(), arenas.begin(), arenas.end());
+  arenas.clear();
+}
+
+void shm_arena::unlink_all() {
+  for (auto a: arenas) {
+    if (a->name.find('/', 1) != std::string::npos) unlink(a->name.c_str());
+    else shm_unlink(a->name.c_str());
+  }
+}
@@ -8,6 +8,7 @@
 #include "util.h"
 #include "cmd_server.h"
 #include "sim/axi/state_machine.h"
+#include <atomic>
 #include <csignal>
 
 #ifdef VERILATOR
@@ -17,11 +18,10 @@
 
 extern pthread_mutex_t cmdserverlock;
 extern std::queue<beethoven::rocc_cmd> cmds;
-extern std::unordered_map<system_core_pair, std::queue<int> *> in_flight;
 extern uint64_t main_time;
 extern uint64_t time_last_command;
 int cmds_inflight = 0;
-extern bool kill_sig;
+extern std::atomic<bool> kill_sig;
 
 extern uint64_t memory_transacted;
 
@@ -3,15 +3,25 @@
 #include "BeethovenTop.h"
 #include "cmd_server.h"
 #include "data_server.h"
+#include <atomic>
 #include <csignal>
 #include <chrono>
 #include <pthread.h>
 #include <queue>
 #include <verilated.h>
+#if defined(RESP_VALID_SIGNAL) && !defined(FRONT_BUS_POLL_RESPONSES)
+#include <verilated_syms.h>
+#endif
 
 #include "sim/mem_ctrl.h"
 #include "sim/verilator.h"
 #include "sim/tick.h"
+#include "sim/sweep.h"
+#include "sim/profiler.h"
+#include "sim/clock_scheduler.h"
+#include "sim/mem_pipeline.h"
+#include "sim/cmd_report.h"
+#include "affinity.h"
 
 #include <beethoven_hardware.h>
 #include "util.h"
@@ -36,7 +46,7 @@ bool active_reset = false;
 BeethovenTop top;
 
 pthread_mutex_t main_lock = PTHREAD_MUTEX_INITIALIZER;
-bool kill_sig = false;
+std::atomic<bool> kill_sig(false);
 
 waveTrace *tfp;
 
@@ -44,7 +54,11 @@ extern int strobe_width;
 
 
 void sig_handle(int sig) {
+  profiler::report(stderr, true);
+  cmd_report::flush();
 #if NUM_DDR_CHANNELS >= 1
+  // we may have interrupted the simulation thread anywhere, so don't wait for it to hand over the cycle in flight
+  mem_pipeline::stop();
   for (auto &q: axi4_mems) {
     q.mem_sys->PrintStats();
   }
@@ -126,12 +140,33 @@ void print_state(uint64_t mem, uint64_t time, uint64_t time_since) {
 
 uint64_t memory_transacted = 0;
 bool use_trace = false;
-float ddr_clock_inc;
+static bool pipeline_mem = false;
+// number of accelerator clock half-periods simulated so far. main_time is always derived from this so that it's exact
+static uint64_t half_periods = 0;
 
-void run_verilator(const std::string &dram_config_file) {
-#if 500000 % FPGA_CLOCK != 0
-  fprintf(stderr, "Provided FPGA clock rate (%d MHz) does not evenly divide 500. This may result in some inaccuracies in precise simulation measurements.", FPGA_CLOCK);
+static void advance_half_period() {
+  main_time = sim_clocks.domains[fpga_clock_domain].half_period_time_ps(++half_periods);
+}
+
+#if defined(RESP_VALID_SIGNAL) && !defined(FRONT_BUS_POLL_RESPONSES)
+// Find RESP_VALID_SIGNAL (a hierarchical name like BeethovenTop.a.b.valid) among the model's public signals. Needs the
+// model to be built with the signal public, which CMake does when RESP_VALID_SIGNAL is set
+static uint8_t *find_resp_valid_signal() {
+  std::string name = RESP_VALID_SIGNAL;
+  auto dot = name.rfind('.');
+  if (dot == std::string::npos) return nullptr;
+  auto scope_name = name.substr(0, dot);
+  auto var_name = name.substr(dot + 1);
+  const VerilatedScope *scope = top.contextp()->scopeFind(scope_name.c_str());
+  if (scope == nullptr) scope = top.contextp()->scopeFind(("TOP." + scope_name).c_str());
+  if (scope == nullptr) return nullptr;
+  VerilatedVar *var = scope->varFind(var_name.c_str());
+  if (var == nullptr || var->vltype() != VLVT_UINT8) return nullptr;
+  return (uint8_t *) var->datap();
+}
 #endif
+
+void run_verilator(const std::string &dram_config_file) {
   /*
   if (trace_file.has_value()) {
     init_trace(*trace_file);
@@ -139,16 +174,11 @@ void run_verilator(const std::string &dram_config_file) {
   }
   */
 
-  auto fpga_clock_inc = 500000 / FPGA_CLOCK;
-
 #if NUM_DDR_CHANNELS >= 1
   mem_ctrl::init(dram_config_file);
-  const float DDR_CLOCK = 1000.0 / dramsim3config->tCK;// NOLINT
-  std::cout << "FPGA CLOCK RATE (MHz): " << FPGA_CLOCK << std::endl;
-  ddr_clock_inc = DDR_CLOCK / FPGA_CLOCK;// NOLINT
-  printf("%f\n", ddr_clock_inc);
-
 #endif
+  std::cout << "FPGA CLOCK RATE (MHz): " << FPGA_CLOCK << std::endl;
+  init_clocks(FPGA_CLOCK);
   // using this to estimate AWS bandwidth
   // KRIA has much slower memory!
   // Config dramsim3config("../DRAMsim3/configs/Kria.ini", "./");
@@ -193,6 +223,7 @@ void run_verilator(const std::string &dram_config_file) {
   for (auto &axi4_mem: axi4_mems) {
     axi4_mem.init_dramsim3();
   }
+  if (pipeline_mem) mem_pipeline::start();
 /**
  * This absolutely sucks to do it this way, but I can't think of a better
  * way to do it that doesn't invoke even uglier and less flexible C macros
@@ -291,11 +322,11 @@ void run_verilator(const std::string &dram_config_file) {
     top.clock = 0;
     tick(&top);
     tfp->dump(main_time);
-    main_time += fpga_clock_inc;
+    advance_half_period();
     top.clock = 1;
     tick(&top);
     tfp->dump(main_time);
-    main_time += fpga_clock_inc;
+    advance_half_period();
   }
   RESET_NAME = !active_reset;
   top.clock = 0;
@@ -320,6 +351,15 @@ void run_verilator(const std::string &dram_config_file) {
   ctrl->set_b(
           GetSetWrapper(top.S00_AXI_bready),
           GetSetWrapper(top.S00_AXI_bvalid));
+#if defined(RESP_VALID_SIGNAL) && !defined(FRONT_BUS_POLL_RESPONSES)
+  if (auto resp_valid = find_resp_valid_signal()) {
+    ctrl->set_resp_valid_probe(GetSetWrapper(*resp_valid));
+    std::cout << "Watching " RESP_VALID_SIGNAL " for responses" << std::endl;
+  } else {
+    std::cerr << "Couldn't find " RESP_VALID_SIGNAL " among the public signals. Falling back to polling RESP_VALID"
+              << std::endl;
+  }
+#endif
 
   top.S00_AXI_arregion = 0;
   top.S00_AXI_arqos = 0;
@@ -353,7 +393,7 @@ void run_verilator(const std::string &dram_config_file) {
     }
 #endif
     top.clock = 1;// posedge
-    main_time += fpga_clock_inc;
+    advance_half_period();
     cycle_count++;
 //    printf("\rCycle count: %lld", cycle_count); fflush(stdout);
     if ((cycle_count & 1000) == 0 &&
@@ -363,25 +403,40 @@ void run_verilator(const std::string &dram_config_file) {
       time_last_print = std::chrono::high_resolution_clock::now();
       fflush(stdout);
     }
+    sweep::maybe_fork(cycle_count);
+    profiler::begin_cycle(cycle_count);
     tick_signals(ctrl);
 //    if (use_trace) {
 //      if (main_time > fpga_clock_inc * 200)
 //        trace_rising_edge_pre(top);
 //    }
-    tick(&top);
+    {
+      profiler::phase_timer eval_timer(PHASE_EVAL_POSEDGE);
+      tick(&top);
+    }
 //    if (use_trace) {
 //      if (main_time > fpga_clock_inc * 200)
 //        trace_rising_edge_post(top);
 //    }
-    tfp->dump(main_time);
+    {
+      profiler::phase_timer dump_timer(PHASE_TRACE_DUMP);
+      tfp->dump(main_time);
+    }
     top.clock = 0;// negedge
-    tick(&top);
-    main_time += fpga_clock_inc;
-    tfp->dump(main_time);
+    {
+      profiler::phase_timer eval_timer(PHASE_EVAL_NEGEDGE);
+      tick(&top);
+    }
+    advance_half_period();
+    {
+      profiler::phase_timer dump_timer(PHASE_TRACE_DUMP);
+      tfp->dump(main_time);
+    }
   }
   LOG(printf("printing traces\n"));
   fflush(stdout);
   tfp->close();
+  if (mem_pipeline::enabled) mem_pipeline::drain();
 #if NUM_DDR_CHANNELS >= 1
   for (auto &axi_mem: axi4_mems) {
     axi_mem.mem_sys->PrintStats();
@@ -398,19 +453,36 @@ int main(int argc, char **argv) {
   signal(SIGKILL, sig_handle);
 
   std::optional<std::string> dram_file = {};
+  std::optional<std::string> sweep_file = {};
+  uint64_t sweep_after = 0;
   for (int i = 1; i < argc; ++i) {
     assert(argv[i][0] == '-');
     if (strcmp(argv[i] + 1, "dramconfig") == 0) {
       dram_file = std::string(argv[i + 1]);
       std::cerr << "dramconfig is " << *dram_file << std::endl;
+    } else if (strcmp(argv[i] + 1, "sweep") == 0) {
+      sweep_file = std::string(argv[i + 1]);
+    } else if (strcmp(argv[i] + 1, "sweep_after") == 0) {
+      sweep_after = strtoull(argv[i + 1], nullptr, 10);
+    } else if (strcmp(argv[i] + 1, "profile") == 0) {
+      profiler::configure(strtoull(argv[i + 1], nullptr, 10));
+    } else if (strcmp(argv[i] + 1, "pipeline_mem") == 0) {
+      pipeline_mem = atoi(argv[i + 1]) != 0;
+    } else if (strcmp(argv[i] + 1, "cmdreport") == 0) {
+      cmd_report::open(argv[i + 1]);
     }
     ++i;
   }
+  if (sweep_file.has_value()) {
+    sweep::configure(*sweep_file, sweep_after);
+  }
 
   if (!dram_file.has_value()) {
     dram_file = std::string("../custom_dram_configs/DDR4_8Gb_x16_3200.ini");
   }
 
+  // the model (and its worker threads, if it's multithreaded) already exists, but no runtime thread does yet
+  affinity::pin_model_threads();
   data_server::start();
   cmd_server::start();
   LOG(printf("Entering verilator\n"));
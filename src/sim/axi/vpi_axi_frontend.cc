@@ -8,12 +8,17 @@
 #include "sim/axi/state_machine.h"
 #include "sim/tick.h"
 #include "sim/axi/vpi_handle.h"
+#include "sim/profiler.h"
+#include "sim/clock_scheduler.h"
+#include "sim/mem_pipeline.h"
+#include "sim/cmd_report.h"
 #include "cmd_server.h"
 #include "data_server.h"
 #include <pthread.h>
 
 #include "beethoven_hardware.h"
 
+#include <atomic>
 #include <cstring>
 #include <vector>
 
@@ -26,9 +31,8 @@ extern int reads_emitted;
 #endif
 uint64_t main_time = 0;
 pthread_mutex_t main_lock = PTHREAD_MUTEX_INITIALIZER;
-float ddr_clock_inc;
-auto fpga_clock_inc = 500000 / DEFAULT_PL_CLOCK;
-bool kill_sig;
+std::atomic<bool> kill_sig(false);
+uint64_t tick_count = 0;
 
 extern "C" {
 PLI_INT32 init_input_signals_calltf(PLI_BYTE8 *user_data);
@@ -39,6 +43,8 @@ PLI_INT32 init_structures_calltf(PLI_BYTE8 *user_data);
 
 PLI_INT32 tick_calltf(PLI_BYTE8 *user_data);
 
+PLI_INT32 end_of_sim_cb(p_cb_data cb_data);
+
 void print_state(uint64_t mem, uint64_t time) {
   return;
   std::string time_string;
@@ -152,8 +158,10 @@ PLI_INT32 init_structures_calltf(PLI_BYTE8 *) {
   }
 
   std::cout << "Mem structures init'd" << std::endl;
+  if (const char *pipeline_mem = getenv("BEETHOVEN_PIPELINE_MEM")) {
+    if (atoi(pipeline_mem) != 0) mem_pipeline::start();
+  }
 
-  ddr_clock_inc = (1000.0 / dramsim3config->tCK) / DEFAULT_PL_CLOCK;
   axi4_mems[0].ar.init(VCSShortHandle(getHandle("M00_AXI_arready")),
                        VCSShortHandle(getHandle("M00_AXI_arvalid")),
                        VCSShortHandle(getHandle("M00_AXI_arid")),
@@ -188,6 +196,7 @@ PLI_INT32 init_structures_calltf(PLI_BYTE8 *) {
 #error "not implemented yet"
 #endif
 #endif
+  init_clocks(DEFAULT_PL_CLOCK);
 
 #ifdef BEETHOVEN_HAS_DMA
   dma.ar.init(VCSShortHandle(getHandle("dma_arready")),
@@ -273,7 +282,28 @@ PLI_INT32 init_structures_calltf(PLI_BYTE8 *) {
   ctrl.set_b(
     VCSShortHandle(getHandle("S00_AXI_bready")),
     VCSShortHandle(getHandle("S00_AXI_bvalid")));
+#if defined(RESP_VALID_SIGNAL) && !defined(FRONT_BUS_POLL_RESPONSES)
+  if (vpiHandle resp_valid = vpi_handle_by_name((PLI_BYTE8 *) RESP_VALID_SIGNAL, nullptr)) {
+    ctrl.set_resp_valid_probe(VCSShortHandle(resp_valid));
+    std::cout << "Watching " RESP_VALID_SIGNAL " for responses" << std::endl;
+  } else {
+    std::cerr << "Couldn't find " RESP_VALID_SIGNAL ". Falling back to polling RESP_VALID" << std::endl;
+  }
+#endif
+
 
+  if (const char *profile_period = getenv("BEETHOVEN_SIM_PROFILE")) {
+    profiler::configure(strtoull(profile_period, nullptr, 10));
+  }
+  if (const char *report_file = getenv("BEETHOVEN_CMD_REPORT")) {
+    cmd_report::open(report_file);
+  }
+  if (profiler::enabled || cmd_report::enabled) {
+    s_cb_data cb{};
+    cb.reason = cbEndOfSimulation;
+    cb.cb_rtn = end_of_sim_cb;
+    vpi_register_cb(&cb);
+  }
 
   std::cout << "start servers" << std::endl;
 
@@ -284,8 +314,15 @@ PLI_INT32 init_structures_calltf(PLI_BYTE8 *) {
   return 0;
 }
 
+PLI_INT32 end_of_sim_cb(p_cb_data) {
+  profiler::report(stderr, true);
+  cmd_report::flush();
+  return 0;
+}
+
 PLI_INT32 tick_calltf(PLI_BYTE8 * /*user_data*/) {
-  main_time += fpga_clock_inc;;
+  profiler::begin_cycle(tick_count++);
+  main_time = sim_clocks.domains[fpga_clock_domain].edge_time_ps(tick_count);
   if (main_time % 10000 == 0) {
     print_state(memory_transacted, main_time);
   }
@@ -5,6 +5,7 @@
 #include "beethoven_allocator_declaration.h"
 #include "sim/axi/front_bus_ctrl_axi.h"
 #include "sim/mem_ctrl.h"
+#include "sim/mem_pipeline.h"
 #include "sim/chipkit/state_machine.h"
 
 unsigned int baud_sel = 14;
@@ -33,6 +34,7 @@ extern VerilatedFstC *tfp;
 #endif
 
 static void sig_handle(int sig) {
+  mem_pipeline::stop();
   for (auto q: axi4_mems) {
     q.mem_sys->PrintEpochStats();
   }
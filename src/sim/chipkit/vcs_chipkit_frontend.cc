@@ -14,7 +14,9 @@
 #include "sim/chipkit/tick.h"
 #include "beethoven_allocator_declaration.h"
 #include "sim/front_bus_ctrl_uart.h"
+#include "sim/clock_scheduler.h"
 
+#include <atomic>
 #include <cstring>
 #include <vector>
 
@@ -33,9 +35,8 @@ extern int reads_emitted;
 #endif
 uint64_t main_time = 0;
 pthread_mutex_t main_lock = PTHREAD_MUTEX_INITIALIZER;
-float ddr_clock_inc;
-auto fpga_clock_inc = 500000 / DEFAULT_PL_CLOCK;
-bool kill_sig;
+uint64_t tick_count = 0;
+std::atomic<bool> kill_sig(false);
 extern "C" PLI_INT32 init_input_signals_calltf(PLI_BYTE8 *user_data);
 extern "C" PLI_INT32 init_output_signals_calltf(PLI_BYTE8 *user_data);
 extern "C" PLI_INT32 init_structures_calltf(PLI_BYTE8 *user_data);
@@ -144,7 +145,6 @@ PLI_INT32 init_structures_calltf(PLI_BYTE8 *) {
     axi4_mem.init_dramsim3();
   }
 
-  ddr_clock_inc = (1000.0 / dramsim3config->tCK) / DEFAULT_PL_CLOCK;
   axi4_mems[0].ar.init(VCSShortHandle(getHandle("M00_AXI_arready")),
                        VCSShortHandle(getHandle("M00_AXI_arvalid")),
                        VCSShortHandle(getHandle("M00_AXI_arid")),
@@ -179,6 +179,7 @@ PLI_INT32 init_structures_calltf(PLI_BYTE8 *) {
 #error "not implemented yet"
 #endif
 #endif
+  init_clocks(DEFAULT_PL_CLOCK);
 
   // initialize the unused fields (e.g., ID)
 
@@ -212,7 +213,7 @@ PLI_INT32 init_structures_calltf(PLI_BYTE8 *) {
 #include "sim/chipkit/util.h"
 
 PLI_INT32 tick_calltf(PLI_BYTE8 * /*user_data*/) {
-  main_time += fpga_clock_inc;;
+  main_time = sim_clocks.domains[fpga_clock_domain].edge_time_ps(++tick_count);
   if (main_time % 1000 == 0) {
     print_state(memory_transacted, main_time);
   }
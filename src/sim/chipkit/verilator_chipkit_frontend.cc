@@ -2,6 +2,7 @@
 
 #include "BeethovenTop.h"
 #include "cmd_server.h"
+#include <atomic>
 #include <csignal>
 #include <pthread.h>
 #include <queue>
@@ -18,20 +19,26 @@
 #include "sim/chipkit/tick.h"
 #include "sim/tick.h"
 #include "sim/chipkit/util.h"
+#include "sim/clock_scheduler.h"
+#include "sim/mem_pipeline.h"
 
 uint64_t main_time = 0;
 
 bool active_reset = true;
 
 extern std::queue<beethoven::rocc_cmd> cmds;
-extern std::unordered_map<system_core_pair, std::queue<int> *> in_flight;
 
 pthread_mutex_t main_lock = PTHREAD_MUTEX_INITIALIZER;
 
 waveTrace *tfp;
 
-float ddr_clock_inc;
 uint64_t memory_transacted = 0;
+// number of accelerator clock half-periods simulated so far. main_time is always derived from this so that it's exact
+static uint64_t half_periods = 0;
+
+static void advance_half_period() {
+  main_time = sim_clocks.domains[fpga_clock_domain].half_period_time_ps(++half_periods);
+}
 
 
 void sig_handle(int sig) {
@@ -54,7 +61,7 @@ void tick(BeethovenTop *top) {
 
 
 
-bool kill_sig = false;
+std::atomic<bool> kill_sig(false);
 
 std::vector<char> memory_array;
 
@@ -82,16 +89,9 @@ static void mem_set(uintptr_t addr, char val) {
 }
 
 void run_verilator(const std::string &dram_config_file) {
-#if 500000 % FPGA_CLOCK != 0
-  fprintf(stderr, "Provided FPGA clock rate (%d MHz) does not evenly divide 500. This may result in some inaccuracies in precise simulation measurements.", FPGA_CLOCK);
-#endif
-
   mem_ctrl::init(dram_config_file);
   std::queue<unsigned char> stdout_strm;
-  const float DDR_CLOCK = 1000.0 / dramsim3config->tCK;// NOLINT
-  auto fpga_clock_inc = 500000 / FPGA_CLOCK;
-  ddr_clock_inc = DDR_CLOCK / FPGA_CLOCK;// NOLINT
-  float ddr_acc = 0;
+  init_clocks(FPGA_CLOCK);
 
   // 0 is the slowest, 14 is the fastest. For whatever reason, 15 isn't working
   set_baud(14);
@@ -201,11 +201,11 @@ void run_verilator(const std::string &dram_config_file) {
     top.clock = 0;
     tick(&top);
     tfp->dump(main_time);
-    main_time += fpga_clock_inc;
+    advance_half_period();
     top.clock = 1;
     tick(&top);
     tfp->dump(main_time);
-    main_time += fpga_clock_inc;
+    advance_half_period();
   }
   top.reset = !active_reset;
   top.clock = 0;
@@ -218,12 +218,12 @@ void run_verilator(const std::string &dram_config_file) {
   while (loops > 0) {
     loops--;
     top.clock = 1;
-    main_time += fpga_clock_inc;
+    advance_half_period();
     tick(&top);
     tfp->dump(main_time);
 
     top.clock = 0;
-    main_time += fpga_clock_inc;
+    advance_half_period();
     tick(&top);
     tfp->dump(main_time);
   }
@@ -242,11 +242,11 @@ void run_verilator(const std::string &dram_config_file) {
       }
 
       top.clock = 1;
-      main_time += fpga_clock_inc;
+      advance_half_period();
       tick(&top);
       tfp->dump(main_time);
       top.clock = 0;
-      main_time += fpga_clock_inc;
+      advance_half_period();
       tick(&top);
       tfp->dump(main_time);
       uart_chipfront.tick();
@@ -265,12 +265,12 @@ void run_verilator(const std::string &dram_config_file) {
       last = uart_chipfront.in_stream.size();
     }
     top.clock = 1;
-    main_time += fpga_clock_inc;
+    advance_half_period();
     tick(&top);
     tfp->dump(main_time);
 
     top.clock = 0;
-    main_time += fpga_clock_inc;
+    advance_half_period();
     tick(&top);
     uart_chipfront.tick();
     tfp->dump(main_time);
@@ -283,12 +283,12 @@ void run_verilator(const std::string &dram_config_file) {
   while (loops > 0) {
     loops--;
     top.clock = 1;
-    main_time += fpga_clock_inc;
+    advance_half_period();
     tick(&top);
     tfp->dump(main_time);
 
     top.clock = 0;
-    main_time += fpga_clock_inc;
+    advance_half_period();
     tick(&top);
     tfp->dump(main_time);
   }
@@ -298,11 +298,11 @@ void run_verilator(const std::string &dram_config_file) {
   top.reset = active_reset;
   for (int i = 0; i < 6; ++i) {
     top.clock = 1;
-    main_time += fpga_clock_inc;
+    advance_half_period();
     tick(&top);
     tfp->dump(main_time);
     top.clock = 0;
-    main_time += fpga_clock_inc;
+    advance_half_period();
     tick(&top);
     tfp->dump(main_time);
   }
@@ -331,7 +331,7 @@ void run_verilator(const std::string &dram_config_file) {
     }
 #endif
     top.clock = 1;// posedge
-    main_time += fpga_clock_inc;
+    advance_half_period();
     // ------------ HANDLE COMMAND INTERFACE ----------------
 //    assert(program.empty());
 //    queue_uart(program, stdout_strm, top.CHIP_UART_M_RXD, top.STDUART_uart_txd);
@@ -349,7 +349,7 @@ void run_verilator(const std::string &dram_config_file) {
     tfp->dump(main_time);
     top.clock = 0;// negedge
     tick(&top);
-    main_time += fpga_clock_inc;
+    advance_half_period();
     tfp->dump(main_time);
   }
   printf("Final stdout print:\n");
@@ -357,6 +357,7 @@ void run_verilator(const std::string &dram_config_file) {
   LOG(printf("printing traces\n"));
   fflush(stdout);
   tfp->close();
+  if (mem_pipeline::enabled) mem_pipeline::drain();
   for (auto &axi_mem: axi4_mems) {
     axi_mem.mem_sys->PrintStats();
   }
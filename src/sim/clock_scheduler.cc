@@ -0,0 +1,52 @@
+#include "sim/clock_scheduler.h"
+#include <cmath>
+#include <iostream>
+
+clock_scheduler sim_clocks;
+int fpga_clock_domain = -1;
+
+namespace {
+  using wide = unsigned __int128;
+
+  // is edge `a` of domain `da` strictly earlier than edge `b` of domain `db`?
+  bool earlier(const clock_domain &da, uint64_t a, const clock_domain &db, uint64_t b) {
+    return wide(a) * db.freq_khz < wide(b) * da.freq_khz;
+  }
+
+  bool not_later(const clock_domain &da, uint64_t a, const clock_domain &db, uint64_t b) {
+    return wide(a) * db.freq_khz <= wide(b) * da.freq_khz;
+  }
+}
+
+int clock_scheduler::add_domain(const std::string &name, uint64_t freq_khz, std::function<void()> on_edge) {
+  if (freq_khz == 0) {
+    std::cerr << "Clock domain '" << name << "' must have a non-zero frequency" << std::endl;
+    throw std::exception();
+  }
+  domains.push_back(clock_domain{name, freq_khz, 0, std::move(on_edge)});
+  return int(domains.size()) - 1;
+}
+
+void clock_scheduler::run_until_next_edge(int master) {
+  auto &m = domains[master];
+  const uint64_t target = m.edges + 1;
+  while (true) {
+    // earliest pending edge among the other domains
+    int next = -1;
+    for (int i = 0; i < (int) domains.size(); ++i) {
+      if (i == master) continue;
+      if (next == -1 || earlier(domains[i], domains[i].edges + 1, domains[next], domains[next].edges + 1))
+        next = i;
+    }
+    if (next == -1) break;
+    auto &d = domains[next];
+    if (!not_later(d, d.edges + 1, m, target)) break;
+    d.edges++;
+    if (d.on_edge) d.on_edge();
+  }
+  m.edges = target;
+}
+
+uint64_t clock_scheduler::khz_from_period_ns(double period_ns) {
+  return (uint64_t) std::llround(1e6 / period_ns);
+}
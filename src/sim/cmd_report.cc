@@ -0,0 +1,171 @@
+#include "sim/cmd_report.h"
+#include "sim/clock_scheduler.h"
+#include "sim/mem_ctrl.h"
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <vector>
+
+namespace cmd_report {
+  bool enabled = false;
+}
+
+namespace {
+  // Running total of every counter, each event divided by the number of commands in flight when it happened. A
+  // command's share is the difference between the totals at its completion and at its issue.
+  struct shares {
+    double bytes_read = 0;
+    double bytes_written = 0;
+    double row_hits = 0;
+    double row_misses = 0;
+  };
+
+  struct open_command {
+    int opcode;
+    uint64_t issue_cycle;
+    shares at_issue;
+    int max_concurrent;
+  };
+
+  FILE *out = nullptr;
+  bool json = false;
+  std::string base_path;
+  shares totals;
+  std::map<std::pair<int, int>, std::deque<open_command>> in_flight;
+  int n_in_flight = 0;
+
+  // last row touched in each bank, per DRAM channel. -1 means the bank is closed
+  std::vector<std::vector<int64_t>> open_rows;
+
+  uint64_t current_cycle() {
+    return sim_clocks.domains[fpga_clock_domain].edges;
+  }
+
+  void charge(double &total, double amount) {
+    if (n_in_flight > 0) total += amount / n_in_flight;
+  }
+
+  void write_header() {
+    if (!json) {
+      fprintf(out, "opcode,system,core,issue_cycle,complete_cycle,cycles,bytes_read,bytes_written,row_hits,row_misses,"
+                   "max_concurrent\n");
+    }
+  }
+
+  bool ends_with(const std::string &s, const std::string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+}
+
+void cmd_report::open(const std::string &path) {
+  out = fopen(path.c_str(), "w");
+  if (out == nullptr) {
+    std::cerr << "Could not open command report '" << path << "'" << std::endl;
+    throw std::exception();
+  }
+  base_path = path;
+  json = ends_with(path, ".json") || ends_with(path, ".jsonl");
+  enabled = true;
+  write_header();
+  std::cout << "Writing per-command report to " << path << std::endl;
+}
+
+void cmd_report::reopen(const std::string &suffix) {
+  if (!enabled) return;
+  // the parent's buffer was flushed before the fork, so closing our copy doesn't write anything twice
+  fclose(out);
+  auto dot = base_path.rfind('.');
+  auto slash = base_path.rfind('/');
+  std::string path;
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    path = base_path + suffix;
+  } else {
+    path = base_path.substr(0, dot) + suffix + base_path.substr(dot);
+  }
+  open(path);
+}
+
+void cmd_report::flush() {
+  if (enabled) fflush(out);
+}
+
+void cmd_report::command_issued(int system_id, int core_id, int opcode) {
+  n_in_flight++;
+  for (auto &core: in_flight) {
+    for (auto &cmd: core.second) {
+      if (cmd.max_concurrent < n_in_flight) cmd.max_concurrent = n_in_flight;
+    }
+  }
+  in_flight[{system_id, core_id}].push_back({opcode, current_cycle(), totals, n_in_flight});
+}
+
+void cmd_report::command_completed(int system_id, int core_id) {
+  auto it = in_flight.find({system_id, core_id});
+  if (it == in_flight.end() || it->second.empty()) {
+    std::cerr << "Command report: response from (" << system_id << ", " << core_id
+              << ") that we never saw a command for" << std::endl;
+    return;
+  }
+  // each core answers its commands in order
+  auto cmd = it->second.front();
+  it->second.pop_front();
+  n_in_flight--;
+
+  auto now = current_cycle();
+  auto share = [](double total, double at_issue) { return (unsigned long long) (total - at_issue + 0.5); };
+  auto bytes_read = share(totals.bytes_read, cmd.at_issue.bytes_read);
+  auto bytes_written = share(totals.bytes_written, cmd.at_issue.bytes_written);
+  auto row_hits = share(totals.row_hits, cmd.at_issue.row_hits);
+  auto row_misses = share(totals.row_misses, cmd.at_issue.row_misses);
+  if (json) {
+    fprintf(out, "{\"opcode\": %d, \"system\": %d, \"core\": %d, \"issue_cycle\": %llu, \"complete_cycle\": %llu, "
+                 "\"cycles\": %llu, \"bytes_read\": %llu, \"bytes_written\": %llu, \"row_hits\": %llu, "
+                 "\"row_misses\": %llu, \"max_concurrent\": %d}\n",
+            cmd.opcode, system_id, core_id, (unsigned long long) cmd.issue_cycle, (unsigned long long) now,
+            (unsigned long long) (now - cmd.issue_cycle), bytes_read, bytes_written, row_hits, row_misses,
+            cmd.max_concurrent);
+  } else {
+    fprintf(out, "%d,%d,%d,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%d\n",
+            cmd.opcode, system_id, core_id, (unsigned long long) cmd.issue_cycle, (unsigned long long) now,
+            (unsigned long long) (now - cmd.issue_cycle), bytes_read, bytes_written, row_hits, row_misses,
+            cmd.max_concurrent);
+  }
+}
+
+void cmd_report::count_read(uint64_t bytes) {
+  charge(totals.bytes_read, double(bytes));
+}
+
+void cmd_report::count_write(uint64_t bytes) {
+  charge(totals.bytes_written, double(bytes));
+}
+
+#if NUM_DDR_CHANNELS >= 1
+
+void cmd_report::count_dram_access(int channel, uint64_t fpga_addr, uint64_t bytes) {
+  auto &config = *dramsim3config;
+  if (open_rows.size() != NUM_DDR_CHANNELS) open_rows.resize(NUM_DDR_CHANNELS);
+  auto &rows = open_rows[channel];
+  auto banks_per_channel = size_t(config.ranks * config.banks);
+  if (rows.size() != banks_per_channel * config.channels) rows.assign(banks_per_channel * config.channels, -1);
+
+  // the memory model sees one request per DDR_ENQUEUE_SIZE_BYTES, so that's the granularity we look at rows with
+  for (uint64_t off = 0; off < bytes; off += DDR_ENQUEUE_SIZE_BYTES) {
+    auto a = config.AddressMapping(fpga_addr + off);
+    auto bank = size_t(a.channel) * banks_per_channel +
+                size_t(a.rank) * config.banks + size_t(a.bankgroup) * config.banks_per_group + a.bank;
+    if (rows[bank] == a.row) {
+      charge(totals.row_hits, 1);
+    } else {
+      charge(totals.row_misses, 1);
+      rows[bank] = a.row;
+    }
+  }
+}
+
+#else
+
+void cmd_report::count_dram_access(int, uint64_t, uint64_t) {}
+
+#endif
@@ -0,0 +1,125 @@
+#include "sim/mem_pipeline.h"
+#include "sim/mem_ctrl.h"
+#include "spsc_queue.h"
+#include <csignal>
+#include <iostream>
+#include <pthread.h>
+#include <thread>
+
+namespace mem_pipeline {
+  bool enabled = false;
+}
+
+#if NUM_DDR_CHANNELS >= 1
+namespace {
+  struct cycle_work {
+    uint64_t seq;
+    uint32_t ddr_edges[NUM_DDR_CHANNELS];
+  };
+
+  // a little slack so that a posted cycle never has to wait for the helper to pick up the previous one
+  spsc_queue<cycle_work, 4> work_q;
+  spsc_queue<uint64_t, 4> done_q;
+  cycle_work current = {};
+  uint64_t n_posted = 0;
+  uint64_t n_done = 0;
+  // bumped on every start() so that a helper left over from before a fork, if any, knows to stop. stop() bumps it too
+  std::atomic<uint64_t> generation(0);
+  // cleared by the helper once it has left the DRAM models alone for good
+  std::atomic<bool> helper_running(false);
+
+  const int spins_before_yield = 1024;
+
+  void *helper_f(void *arg) {
+    auto my_generation = (uint64_t) (uintptr_t) arg;
+    // the frontends' signal handlers print DRAM stats after stop(), which can't work if they interrupt us halfway
+    // through a tick
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, nullptr);
+    cycle_work work{};
+    int spins = 0;
+    while (generation.load(std::memory_order_relaxed) == my_generation) {
+      if (!work_q.try_pop(work)) {
+        if (++spins >= spins_before_yield) {
+          std::this_thread::yield();
+          spins = 0;
+        }
+        continue;
+      }
+      spins = 0;
+      for (int i = 0; i < NUM_DDR_CHANNELS; ++i) {
+        auto &axi4_mem = axi4_mems[i];
+        for (uint32_t e = 0; e < work.ddr_edges[i]; ++e) {
+          axi4_mem.mem_sys->ClockTick();
+          try_to_enqueue_ddr(axi4_mem);
+        }
+      }
+      while (!done_q.try_push(work.seq) && generation.load(std::memory_order_relaxed) == my_generation) {
+        std::this_thread::yield();
+      }
+    }
+    helper_running.store(false, std::memory_order_release);
+    return nullptr;
+  }
+}
+
+void mem_pipeline::start() {
+  enabled = true;
+  work_q.reset();
+  done_q.reset();
+  current = {};
+  n_posted = n_done = 0;
+  pthread_t thread;
+  helper_running.store(true);
+  auto my_generation = generation.fetch_add(1) + 1;
+  pthread_create(&thread, nullptr, helper_f, (void *) (uintptr_t) my_generation);
+  pthread_detach(thread);
+  std::cout << "Running the memory model one cycle behind the design on a helper thread" << std::endl;
+}
+
+void mem_pipeline::count_ddr_edge(int channel) {
+  current.ddr_edges[channel]++;
+}
+
+void mem_pipeline::post() {
+  current.seq = n_posted++;
+  while (!work_q.try_push(current)) std::this_thread::yield();
+  current = {};
+}
+
+void mem_pipeline::drain() {
+  uint64_t seq;
+  int spins = 0;
+  while (n_done < n_posted) {
+    if (done_q.try_pop(seq)) {
+      n_done++;
+    } else if (++spins >= spins_before_yield) {
+      std::this_thread::yield();
+      spins = 0;
+    }
+  }
+}
+
+void mem_pipeline::stop() {
+  if (!enabled) return;
+  enabled = false;
+  generation.fetch_add(1);
+  while (helper_running.load(std::memory_order_acquire)) std::this_thread::yield();
+}
+
+#else
+
+void mem_pipeline::start() {
+  std::cerr << "No DRAM channels to pipeline. Ignoring the pipelined memory option" << std::endl;
+}
+
+void mem_pipeline::count_ddr_edge(int) {}
+
+void mem_pipeline::post() {}
+
+void mem_pipeline::drain() {}
+
+void mem_pipeline::stop() {}
+
+#endif
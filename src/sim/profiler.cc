@@ -0,0 +1,96 @@
+#include "sim/profiler.h"
+
+namespace profiler {
+  bool enabled = false;
+  thread_local bool sampling = false;
+}
+
+namespace {
+  using wall_clock = std::chrono::steady_clock;
+  const char *phase_names[N_SIM_PHASES] = {
+          "eval (posedge)",
+          "eval (negedge)",
+          "trace dump",
+          "tick_signals",
+          "  front bus",
+          "  DRAM ticks",
+          "  AXI channels",
+          "  lock waits",
+          "  DRAM pipe wait",
+  };
+  const sim_phase top_level_phases[] = {PHASE_EVAL_POSEDGE, PHASE_EVAL_NEGEDGE, PHASE_TRACE_DUMP, PHASE_TICK_SIGNALS};
+  const int report_interval_s = 5;
+
+  uint64_t sample_period = 0;
+  uint64_t phase_ticks[N_SIM_PHASES] = {};
+  // sum of the full length of every sampled cycle, so that the phases can be shown as a fraction of it
+  uint64_t sampled_cycle_ticks = 0;
+  uint64_t n_samples = 0;
+  uint64_t cycle_start = 0;
+
+  uint64_t cycles_total = 0;
+  uint64_t cycles_at_last_report = 0;
+  wall_clock::time_point time_start, time_last_report;
+  uint64_t ticks_start = 0;
+}
+
+void profiler::configure(uint64_t period) {
+  sample_period = period == 0 ? 1 : period;
+  enabled = true;
+  time_start = time_last_report = wall_clock::now();
+  ticks_start = timestamp();
+  fprintf(stderr, "Profiling simulator phases every %lu cycles\n", (unsigned long) sample_period);
+}
+
+void profiler::begin_cycle(uint64_t cycle) {
+  if (!enabled) return;
+  cycles_total++;
+  if (sampling) {
+    sampled_cycle_ticks += timestamp() - cycle_start;
+    n_samples++;
+    sampling = false;
+  }
+  if (cycle % sample_period != 0) return;
+  if (std::chrono::duration_cast<std::chrono::seconds>(wall_clock::now() - time_last_report).count() >=
+      report_interval_s) {
+    report(stderr, false);
+  }
+  sampling = true;
+  cycle_start = timestamp();
+}
+
+void profiler::record(sim_phase phase, uint64_t ticks) {
+  phase_ticks[phase] += ticks;
+}
+
+void profiler::report(FILE *f, bool final) {
+  if (!enabled) return;
+  auto now = wall_clock::now();
+  double since_last = std::chrono::duration<double>(now - time_last_report).count();
+  double since_start = std::chrono::duration<double>(now - time_start).count();
+  double khz_recent = since_last > 0 ? double(cycles_total - cycles_at_last_report) / since_last / 1000 : 0;
+  double khz_overall = since_start > 0 ? double(cycles_total) / since_start / 1000 : 0;
+  // timestamp counter rate, calibrated against the steady clock over the whole run
+  double ticks_per_us = since_start > 0 ? double(timestamp() - ticks_start) / since_start / 1e6 : 1;
+
+  fprintf(f, "\n[profile%s] %lu cycles, %.2f kHz (recent %.2f kHz), %lu samples\n", final ? " final" : "",
+          (unsigned long) cycles_total, khz_overall, khz_recent, (unsigned long) n_samples);
+  if (n_samples > 0 && sampled_cycle_ticks > 0) {
+    auto print_line = [&](const char *name, uint64_t ticks) {
+      double per_cycle_us = double(ticks) / double(n_samples) / ticks_per_us;
+      double share = 100.0 * double(ticks) / double(sampled_cycle_ticks);
+      fprintf(f, "  %-16s %10.3f %7.1f%%\n", name, per_cycle_us, share);
+    };
+    fprintf(f, "  %-16s %10s %8s\n", "phase", "us/cycle", "share");
+    for (int i = 0; i < N_SIM_PHASES; ++i) {
+      if (phase_ticks[i] == 0) continue;
+      print_line(phase_names[i], phase_ticks[i]);
+    }
+    uint64_t covered = 0;
+    for (auto p: top_level_phases) covered += phase_ticks[p];
+    if (covered < sampled_cycle_ticks) print_line("other", sampled_cycle_ticks - covered);
+  }
+  fflush(f);
+  cycles_at_last_report = cycles_total;
+  time_last_report = now;
+}
@@ -0,0 +1,161 @@
+#include "sim/sweep.h"
+#include "beethoven_hardware.h"
+#include "cmd_server.h"
+#include "data_server.h"
+#include "sim/mem_ctrl.h"
+#include "sim/mem_pipeline.h"
+#include "sim/cmd_report.h"
+#include "sim/tick.h"
+#include "sim/verilator.h"
+#include "util.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef DEFAULT_PL_CLOCK
+#define FPGA_CLOCK 100
+#else
+#define FPGA_CLOCK DEFAULT_PL_CLOCK
+#endif
+
+extern pthread_mutex_t cmdserverlock;
+extern std::queue<beethoven::rocc_cmd> cmds;
+extern int cmds_inflight;
+
+namespace {
+  bool armed = false;
+  uint64_t fork_after = 0;
+  // one entry per child. Empty means "keep the current memory model"
+  std::vector<std::string> child_dram_configs;
+
+  bool memory_is_idle() {
+#if NUM_DDR_CHANNELS >= 1
+    for (auto &axi4_mem: axi4_mems) {
+      if (!axi4_mem.ddr_read_q.empty() || !axi4_mem.ddr_write_q.empty() ||
+          !axi4_mem.read_transactions.empty() || !axi4_mem.write_transactions.empty() ||
+          axi4_mem.num_in_flight_writes != 0 ||
+          !axi4_mem.b.send_ids.empty() || !axi4_mem.b.to_enqueue.empty())
+        return false;
+    }
+#endif
+#ifdef BEETHOVEN_HAS_DMA
+    if (dma_valid || !dma_queue.empty()) return false;
+#endif
+    return true;
+  }
+
+  bool commands_are_idle() {
+    return cmds.empty() && cmds_inflight == 0 && in_flight.empty();
+  }
+
+  void become_child(int k) {
+    shm_instance_suffix = "_sweep" + std::to_string(k);
+    // the server threads didn't survive the fork, we restart them below
+    data_server::copy_allocations_for_sweep();
+
+    const auto &dram_config = child_dram_configs[k];
+#if NUM_DDR_CHANNELS >= 1
+    if (!dram_config.empty()) {
+      mem_ctrl::init(dram_config);
+      for (auto &axi4_mem: axi4_mems) {
+        axi4_mem.init_dramsim3();
+      }
+      init_clocks(FPGA_CLOCK);
+    }
+#endif
+    if (mem_pipeline::enabled) mem_pipeline::start();
+    cmd_report::reopen(shm_instance_suffix);
+
+    tfp->open(("trace" + shm_instance_suffix + TRACE_FILE_ENDING).c_str());
+    std::cout << "Sweep child " << k << " (pid " << getpid() << ") continuing with "
+              << (dram_config.empty() ? std::string("the warm-up memory model") : dram_config) << std::endl;
+    cmd_server::start();
+    data_server::start();
+  }
+}
+
+void sweep::configure(const std::string &sweep_file, uint64_t fork_after_cycle) {
+  std::ifstream f(sweep_file);
+  if (!f.is_open()) {
+    std::cerr << "Could not open sweep file '" << sweep_file << "'" << std::endl;
+    throw std::exception();
+  }
+  std::string line;
+  while (std::getline(f, line)) {
+    if (line == "-") line.clear();
+    child_dram_configs.push_back(line);
+  }
+  if (child_dram_configs.empty()) {
+    std::cerr << "Sweep file '" << sweep_file << "' does not describe any children" << std::endl;
+    throw std::exception();
+  }
+  fork_after = fork_after_cycle;
+  armed = true;
+}
+
+void sweep::maybe_fork(uint64_t cycle) {
+  if (!armed || cycle < fork_after) return;
+  // the memory model helper thread must not be halfway through a cycle when we look at (and copy) its queues
+  if (mem_pipeline::enabled) mem_pipeline::drain();
+  // Don't fork while another thread is halfway through updating state that we're about to copy. If anything is
+  // busy, just try again next cycle.
+  if (pthread_rwlock_trywrlock(&data_server_busy)) return;
+  if (pthread_mutex_trylock(&cmdserverlock)) {
+    pthread_rwlock_unlock(&data_server_busy);
+    return;
+  }
+#ifdef BEETHOVEN_HAS_DMA
+  if (pthread_mutex_trylock(&dma_lock)) {
+    pthread_mutex_unlock(&cmdserverlock);
+    pthread_rwlock_unlock(&data_server_busy);
+    return;
+  }
+#endif
+  bool quiescent = commands_are_idle() && memory_is_idle();
+  if (quiescent) {
+    armed = false;
+    std::cout << std::endl << "Warm-up finished at cycle " << cycle << ". Forking " << child_dram_configs.size()
+              << " sweep children" << std::endl;
+    // The children each write their own trace, so finish the prefix trace here instead of having every child try to
+    // finalize the same file
+    tfp->close();
+    cmd_report::flush();
+    fflush(stdout);
+    fflush(stderr);
+    std::vector<pid_t> children;
+    for (int k = 0; k < (int) child_dram_configs.size(); ++k) {
+      pid_t pid = fork();
+      if (pid < 0) {
+        std::cerr << "Failed to fork sweep child " << k << ": " << strerror(errno) << std::endl;
+        break;
+      } else if (pid == 0) {
+#ifdef BEETHOVEN_HAS_DMA
+        pthread_mutex_unlock(&dma_lock);
+#endif
+        pthread_mutex_unlock(&cmdserverlock);
+        // data server workers may have been queued up on this one, and they're gone now
+        pthread_rwlock_init(&data_server_busy, nullptr);
+        become_child(k);
+        return;
+      }
+      children.push_back(pid);
+    }
+    for (int k = 0; k < (int) children.size(); ++k) {
+      int status;
+      waitpid(children[k], &status, 0);
+      std::cout << "Sweep child " << k << " exited with status "
+                << (WIFEXITED(status) ? WEXITSTATUS(status) : -1) << std::endl;
+    }
+    sig_handle(0);
+  }
+#ifdef BEETHOVEN_HAS_DMA
+  pthread_mutex_unlock(&dma_lock);
+#endif
+  pthread_mutex_unlock(&cmdserverlock);
+  pthread_rwlock_unlock(&data_server_busy);
+}
@@ -4,6 +4,14 @@
 #include "sim/tick.h"
 #include "beethoven_hardware.h"
 #include "sim/mem_ctrl.h"
+#include "sim/profiler.h"
+#include "sim/clock_scheduler.h"
+#include "sim/mem_pipeline.h"
+#include "sim/cmd_report.h"
+#include "shm_futex.h"
+#include <cstring>
+#include <iostream>
+#include <string>
 
 #ifdef VERILATOR
 #ifdef USE_VCD
@@ -15,9 +23,7 @@ extern VerilatedFstC *tfp;
 #endif
 #endif
 
-float ddr_acc = 0;
 int strobe_width;
-extern float ddr_clock_inc;
 extern uint64_t memory_transacted;
 int dma_wait = 50;
 int id1, id2;
@@ -25,29 +31,91 @@ int id1, id2;
 extern mem_intf_t axi4_mems[NUM_DDR_CHANNELS];
 #endif
 
+static ControlIntf *scheduled_ctrl = nullptr;
+static int ctrl_clock_domain = -1;
+
+void init_clocks(uint64_t fpga_clock_mhz) {
+  sim_clocks.clear();
+  fpga_clock_domain = sim_clocks.add_domain("fpga", fpga_clock_mhz * 1000);
+#if NUM_DDR_CHANNELS >= 1
+  auto ddr_khz = clock_scheduler::khz_from_period_ns(dramsim3config->tCK);
+  for (int i = 0; i < NUM_DDR_CHANNELS; ++i) {
+    auto &axi4_mem = axi4_mems[i];
+    sim_clocks.add_domain("ddr" + std::to_string(i), ddr_khz, [&axi4_mem, i]() {
+      if (mem_pipeline::enabled) {
+        mem_pipeline::count_ddr_edge(i);
+        return;
+      }
+      axi4_mem.mem_sys->ClockTick();
+      try_to_enqueue_ddr(axi4_mem);
+    });
+  }
+#endif
+#ifdef CONTROL_CLOCK_MHZ
+  ctrl_clock_domain = sim_clocks.add_domain("control", uint64_t(CONTROL_CLOCK_MHZ) * 1000,
+                                            []() { scheduled_ctrl->tick(); });
+#endif
+  for (const auto &d: sim_clocks.domains) {
+    std::cout << "Clock domain " << d.name << ": " << d.freq_khz << " kHz" << std::endl;
+  }
+}
+
+static void tick_channels();
+
+#ifdef BEETHOVEN_HAS_DMA
+// the current burst is done. Call with dma_lock held
+static void finish_dma_burst() {
+  dma_valid = false;
+  dma_in_progress = false;
+  if (dma_bursts_left->fetch_sub(1) == 1) shm_futex::wake(dma_bursts_left);
+}
+
+// the FILL or COPY holding the DMA port, and how many more cycles it holds it for
+static dma_descriptor dma_backing_op;
+static uint64_t dma_busy_cycles;
+#endif
+
 void tick_signals(ControlIntf *ctrl) {
+  profiler::phase_timer tick_timer(PHASE_TICK_SIGNALS);
 
 // ------------ HANDLE COMMAND INTERFACE ----------------
 // start queueing up a new command if one is available
 
-  ctrl->tick();
+  scheduled_ctrl = ctrl;
+  if (ctrl_clock_domain < 0) {
+    profiler::phase_timer front_bus_timer(PHASE_FRONT_BUS);
+    ctrl->tick();
+  }
 
-#if NUM_DDR_CHANNELS >= 1
-// ------------ HANDLE MEMORY INTERFACES ----------------
-  // approx clock diff
-  ddr_acc += ddr_clock_inc;
-  while (ddr_acc >= 1) {
-    for (auto &axi4_mem: axi4_mems) {
-      axi4_mem.mem_sys->ClockTick();
-      try_to_enqueue_ddr(axi4_mem);
+  {
+    // every DRAM (and control bus) edge up to and including this accelerator edge
+    profiler::phase_timer dram_timer(PHASE_DRAM_TICK);
+    sim_clocks.run_until_next_edge(fpga_clock_domain);
+  }
+
+  if (mem_pipeline::enabled) {
+    // the channels below consume what the memory model did last cycle, so that has to be done first
+    {
+      profiler::phase_timer wait_timer(PHASE_MEM_PIPELINE_WAIT);
+      mem_pipeline::drain();
     }
-    ddr_acc -= 1;
+    tick_channels();
+    // this cycle's DRAM edges run on the helper thread while the design is evaluated
+    mem_pipeline::post();
+  } else {
+    tick_channels();
   }
+}
 
+static void tick_channels() {
+#if NUM_DDR_CHANNELS >= 1
+// ------------ HANDLE MEMORY INTERFACES ----------------
+  profiler::phase_timer channel_timer(PHASE_AXI_CHANNELS);
 
   for (auto &axi4_mem: axi4_mems) {
     if (axi4_mem.r.getValid() && axi4_mem.r.getReady()) {
       memory_transacted += (DATA_BUS_WIDTH >> 3);
+      if (cmd_report::enabled) cmd_report::count_read(DATA_BUS_WIDTH >> 3);
       RLOCK
       auto tx = axi4_mem.read_transactions.front();
       tx->axi_bus_beats_progress++;
@@ -68,6 +136,7 @@ void tick_signals(ControlIntf *ctrl) {
       auto txlen = (int) (axi4_mem.ar.getLen()) + 1;
       auto tx = std::make_shared<mem_ctrl::memory_transaction>((uintptr_t) ad, txsize, txlen, 0, false,
                                                                axi4_mem.ar.getId(), addr, false);
+      if (cmd_report::enabled) cmd_report::count_dram_access(axi4_mem.id, addr, uint64_t(txsize) * txlen);
       RLOCK
       axi4_mem.ddr_read_q.push_back(tx);
       RUNLOCK
@@ -131,6 +200,7 @@ void tick_signals(ControlIntf *ctrl) {
                                                                  fpga_addr, false);
         axi4_mem.write_transactions.push(tx);
         axi4_mem.num_in_flight_writes++;
+        if (cmd_report::enabled) cmd_report::count_dram_access(axi4_mem.id, fpga_addr, uint64_t(sz) * len);
       } catch (std::exception &e) {
 #ifdef VERILATOR
         tfp->dump(main_time);
@@ -148,13 +218,16 @@ void tick_signals(ControlIntf *ctrl) {
         int off = 0;
         auto addr = trans->addr;
         auto data = axi4_mem.w.getData();
+        uint64_t strobed = 0;
         while (off < DATA_BUS_WIDTH / 8) {
           if (axi4_mem.w.getStrb(off)) {
             reinterpret_cast<uint8_t *>(addr)[off] = data.get()[off];
             memory_transacted++;
+            strobed++;
           }
           off += 1;
         }
+        if (cmd_report::enabled) cmd_report::count_write(strobed);
         trans->axi_bus_beats_progress++;
 
         if (not trans->fixed) {
@@ -189,14 +262,42 @@ void tick_signals(ControlIntf *ctrl) {
   }
 
 #ifdef BEETHOVEN_HAS_DMA
-  pthread_mutex_lock(&dma_lock);
+  profiler::lock(&dma_lock);
   // enqueue dma transaction into dma axi interface
   dma.aw.setValid(0);
   dma.ar.setValid(0);
   dma.b.setReady(0);
   dma.w.setValid(0);
   dma.r.setReady(0);
-  if (dma_valid && not dma_in_progress) {
+  if (!dma_valid && !dma_queue.empty()) {
+    auto &next = dma_queue.front();
+    dma_ptr = next.ptr;
+    dma_fpga_addr = next.fpga_addr;
+    dma_len = next.len;
+    dma_write = next.write;
+    dma_bursts_left = next.bursts_left;
+    if (next.kind != DMA_MOVE) {
+      dma_backing_op = next;
+      // a beat per 64B, and a copy both reads and writes them
+      dma_busy_cycles = (next.len + 63) / 64 * (next.kind == DMA_COPY ? 2 : 1);
+    }
+    dma_queue.pop_front();
+    dma_valid = true;
+    dma_in_progress = false;
+  }
+  if (dma_valid && dma_backing_op.kind != DMA_MOVE) {
+    if (dma_busy_cycles <= 1) {
+      if (dma_backing_op.kind == DMA_FILL) {
+        memset(dma_backing_op.ptr, dma_backing_op.fill_value, dma_backing_op.len);
+      } else {
+        memcpy(dma_backing_op.ptr, dma_backing_op.src, dma_backing_op.len);
+      }
+      dma_backing_op.kind = DMA_MOVE;
+      finish_dma_burst();
+    } else {
+      --dma_busy_cycles;
+    }
+  } else if (dma_valid && not dma_in_progress) {
     dma_txprogress = 0;
     dma_txlength = int(dma_len >> 6);
     if (dma_write) {
@@ -242,9 +343,7 @@ void tick_signals(ControlIntf *ctrl) {
           if (dma.b.getId() != id1) {
             printf("Huh! %d != %d\n", dma.b.getId(), id1);
           }
-          dma_valid = false;
-          dma_in_progress = false;
-          pthread_mutex_unlock(&dma_wait_lock);
+          finish_dma_burst();
         }
       }
     } else {
@@ -262,9 +361,7 @@ void tick_signals(ControlIntf *ctrl) {
         }
         dma_txprogress++;
         if (dma_txprogress == dma_txlength) {
-          dma_valid = false;
-          dma_in_progress = false;
-          pthread_mutex_unlock(&dma_wait_lock);
+          finish_dma_burst();
         }
       }
     }
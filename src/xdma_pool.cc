@@ -0,0 +1,167 @@
+#include "xdma_pool.h"
+#include "fpga_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if AWS
+namespace {
+  enum transfer_kind {
+    XFER_WRITE,
+    XFER_READ,
+    // every chunk is written from the same chunk-sized `buffer`
+    XFER_FILL,
+    // every chunk is read from `src_addr` into a per-channel bounce buffer and written back out
+    XFER_COPY
+  };
+
+  struct transfer {
+    uint8_t *buffer;
+    size_t xfer_sz;
+    uint64_t fpga_addr;
+    uint64_t src_addr;
+    transfer_kind kind;
+    size_t chunk;
+    size_t n_chunks;
+    // the next chunk that a channel thread will pick up
+    std::atomic<size_t> next{0};
+    std::atomic<int> rc{0};
+
+    std::mutex mut;
+    std::condition_variable done_cv;
+    size_t chunks_done = 0;
+  };
+
+  struct transfer_queue {
+    std::mutex mut;
+    std::condition_variable cv;
+    // transfers that still have chunks to hand out, oldest first. Every channel thread works on the front one
+    std::deque<std::shared_ptr<transfer>> pending;
+  };
+
+  // never destroyed: the channel threads wait on it until the very end, and destroying a condition variable that
+  // still has waiters hangs the exit
+  transfer_queue &q = *new transfer_queue;
+
+  size_t chunk_bytes() {
+    static size_t bytes = [] {
+      const char *v = getenv("BEETHOVEN_XDMA_CHUNK_KB");
+      size_t kb = v ? strtoull(v, nullptr, 10) : 1024;
+      return std::max<size_t>(kb, 4) << 10;
+    }();
+    return bytes;
+  }
+
+  int run_chunk(const transfer &t, int ch, size_t off, size_t len) {
+    switch (t.kind) {
+      case XFER_WRITE:
+        return wrapper_fpga_dma_burst_write(xdma_write_fds[ch], t.buffer + off, len, t.fpga_addr + off);
+      case XFER_READ:
+        return wrapper_fpga_dma_burst_read(xdma_read_fds[ch], t.buffer + off, len, t.fpga_addr + off);
+      case XFER_FILL:
+        return wrapper_fpga_dma_burst_write(xdma_write_fds[ch], t.buffer, len, t.fpga_addr + off);
+      case XFER_COPY: {
+        thread_local std::vector<uint8_t> bounce;
+        if (bounce.size() < len) bounce.resize(len);
+        int rc = wrapper_fpga_dma_burst_read(xdma_read_fds[ch], bounce.data(), len, t.src_addr + off);
+        if (rc) return rc;
+        return wrapper_fpga_dma_burst_write(xdma_write_fds[ch], bounce.data(), len, t.fpga_addr + off);
+      }
+    }
+    return -1;
+  }
+
+  [[noreturn]] void channel_f(int ch) {
+    while (true) {
+      std::shared_ptr<transfer> t;
+      size_t c;
+      {
+        std::unique_lock<std::mutex> lk(q.mut);
+        while (true) {
+          q.cv.wait(lk, [] { return !q.pending.empty(); });
+          t = q.pending.front();
+          c = t->next.fetch_add(1);
+          if (c < t->n_chunks) break;
+          // all of its chunks have been handed out, move on to the next transfer
+          q.pending.pop_front();
+        }
+      }
+      auto off = c * t->chunk;
+      auto len = std::min(t->chunk, t->xfer_sz - off);
+      int rc = run_chunk(*t, ch, off, len);
+      if (rc) {
+        int expected = 0;
+        t->rc.compare_exchange_strong(expected, rc);
+      }
+      std::lock_guard<std::mutex> lk(t->mut);
+      if (++t->chunks_done == t->n_chunks) t->done_cv.notify_all();
+    }
+  }
+
+  void start_channels() {
+    for (int ch = 0; ch < xdma_n_channels; ++ch) std::thread(channel_f, ch).detach();
+  }
+
+  int transfer_all(uint8_t *buffer, size_t xfer_sz, uint64_t fpga_addr, transfer_kind kind, uint64_t src_addr = 0) {
+    auto chunk = chunk_bytes();
+    // fills and copies always go in chunks, as that's all the host memory they have
+    if ((kind == XFER_WRITE || kind == XFER_READ) && (xdma_n_channels <= 1 || xfer_sz <= chunk)) {
+      return kind == XFER_WRITE ? wrapper_fpga_dma_burst_write(xdma_write_fd, buffer, xfer_sz, fpga_addr)
+                                : wrapper_fpga_dma_burst_read(xdma_read_fd, buffer, xfer_sz, fpga_addr);
+    }
+    static std::once_flag started;
+    std::call_once(started, start_channels);
+
+    auto t = std::make_shared<transfer>();
+    t->buffer = buffer;
+    t->xfer_sz = xfer_sz;
+    t->fpga_addr = fpga_addr;
+    t->src_addr = src_addr;
+    t->kind = kind;
+    t->chunk = chunk;
+    t->n_chunks = (xfer_sz + chunk - 1) / chunk;
+    {
+      std::lock_guard<std::mutex> lk(q.mut);
+      q.pending.push_back(t);
+    }
+    q.cv.notify_all();
+    std::unique_lock<std::mutex> lk(t->mut);
+    t->done_cv.wait(lk, [&] { return t->chunks_done == t->n_chunks; });
+    return t->rc.load();
+  }
+}
+
+int xdma_pool::write(uint8_t *buffer, size_t xfer_sz, uint64_t fpga_addr) {
+  return transfer_all(buffer, xfer_sz, fpga_addr, XFER_WRITE);
+}
+
+int xdma_pool::read(uint8_t *buffer, size_t xfer_sz, uint64_t fpga_addr) {
+  return transfer_all(buffer, xfer_sz, fpga_addr, XFER_READ);
+}
+
+int xdma_pool::fill(uint8_t value, size_t xfer_sz, uint64_t fpga_addr) {
+  // one chunk of the pattern per value we've been asked for, kept around because fills tend to repeat
+  static std::mutex mut;
+  static std::map<uint8_t, std::vector<uint8_t>> patterns;
+  uint8_t *pattern;
+  {
+    std::lock_guard<std::mutex> lk(mut);
+    auto &p = patterns[value];
+    if (p.empty()) p.assign(chunk_bytes(), value);
+    pattern = p.data();
+  }
+  return transfer_all(pattern, xfer_sz, fpga_addr, XFER_FILL);
+}
+
+int xdma_pool::copy(uint64_t dst_addr, uint64_t src_addr, size_t xfer_sz) {
+  return transfer_all(nullptr, xfer_sz, dst_addr, XFER_COPY, src_addr);
+}
+
+#endif
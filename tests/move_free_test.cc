@@ -0,0 +1,53 @@
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include "data_ring.h"
+
+// Start a move over the data ring and free its allocation right behind it, without waiting. The free goes to another
+// server thread than the move, so the runtime has to keep the memory around until the move is done with it. Run it
+// against a live runtime: if it doesn't, the runtime crashes (or the DMA lands in freed memory) instead of this
+// finishing. Every move has to either complete, or have been refused (EFAULT) because the free got there first
+
+using namespace beethoven;
+
+static uint64_t wait_for(data_ring_file *ring, uint32_t t, int32_t &status) {
+  data_ring::wait(ring, t);
+  status = ring->tokens[t].status;
+  auto arg = ring->tokens[t].arg[0];
+  data_ring::release(ring, t);
+  return arg;
+}
+
+int main() {
+  auto ring = data_ring::open();
+  if (ring == nullptr) return 1;
+  const uint64_t len = 1 << 20;
+  int moved = 0, refused = 0;
+  for (int i = 0; i < 256; ++i) {
+    int32_t status;
+    auto t = data_ring::submit(ring, data_server_op::ALLOC, len);
+    uint64_t fpga_addr = wait_for(ring, t, status);
+    if (status != 0 || fpga_addr == 0) {
+      std::cerr << "ALLOC failed: " << strerror(status) << std::endl;
+      return 1;
+    }
+    auto move = i % 2 ? data_ring::copy_from_fpga(ring, fpga_addr, len) : data_ring::copy_to_fpga(ring, fpga_addr, len);
+    auto freed = data_ring::submit(ring, data_server_op::FREE, fpga_addr);
+    wait_for(ring, freed, status);
+    if (status != 0) {
+      std::cerr << "FREE failed: " << strerror(status) << std::endl;
+      return 1;
+    }
+    wait_for(ring, move, status);
+    if (status == 0) {
+      moved++;
+    } else if (status == EFAULT) {
+      refused++;
+    } else {
+      std::cerr << "Move failed: " << strerror(status) << std::endl;
+      return 1;
+    }
+  }
+  std::cout << moved << " moves finished before their free, " << refused << " came after it" << std::endl;
+  return 0;
+}
@@ -0,0 +1,64 @@
+// Cost of one FPGA -> host address translation versus the number of live mappings. "scan" is the linear walk that
+// translate() used to do, "random" jumps to a different mapping on every call (cache misses, upper_bound lookups) and
+// "streams" interleaves four sequential streams, like a few AXI read/write ports working through their buffers.
+
+#include "address_translator.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+address_translator at;
+
+static const uint64_t mapping_size = 1 << 16;
+static const uint64_t mapping_stride = 1 << 20;
+static const int n_lookups = 1 << 20;
+
+static void *scan(const address_translator &t, uint64_t fp_addr) {
+  for (const auto &m: t.mappings) {
+    if (m.fpga_addr <= fp_addr && m.fpga_addr + m.mapping_length > fp_addr) {
+      return (char *) m.cpu_addr + (fp_addr - m.fpga_addr);
+    }
+  }
+  return nullptr;
+}
+
+template<typename F>
+static double ns_per_lookup(const std::vector<uint64_t> &addrs, F f) {
+  uintptr_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (auto a: addrs) sink += (uintptr_t) f(a);
+  auto end = std::chrono::steady_clock::now();
+  // keep the lookups from being optimized away
+  if (sink == 1) printf(" ");
+  return double(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) / double(addrs.size());
+}
+
+int main() {
+  static char backing[mapping_size];
+  std::mt19937_64 rng(0);
+  printf("%10s %12s %12s %12s\n", "mappings", "scan (ns)", "random (ns)", "streams (ns)");
+  for (int n: {1, 16, 64, 256, 1024, 4096}) {
+    address_translator t;
+    for (int i = 0; i < n; ++i) t.add_mapping(uint64_t(i) * mapping_stride, mapping_size, backing);
+
+    std::vector<uint64_t> random_addrs(n_lookups), stream_addrs(n_lookups);
+    for (auto &a: random_addrs) a = (rng() % n) * mapping_stride + rng() % mapping_size;
+    uint64_t streams[4];
+    for (auto &s: streams) s = (rng() % n) * mapping_stride;
+    for (int i = 0; i < n_lookups; ++i) {
+      auto &s = streams[i % 4];
+      stream_addrs[i] = s;
+      // 64B beats, wrapping around inside the mapping
+      s = (s - s % mapping_stride) + (s % mapping_stride + 64) % mapping_size;
+    }
+
+    // the linear scan is very slow for many mappings, so time it on fewer lookups
+    std::vector<uint64_t> scan_addrs(random_addrs.begin(), random_addrs.begin() + (n > 256 ? n_lookups / 64 : n_lookups));
+    double scan_ns = ns_per_lookup(scan_addrs, [&](uint64_t a) { return scan(t, a); });
+    double random_ns = ns_per_lookup(random_addrs, [&](uint64_t a) { return t.translate(a); });
+    double stream_ns = ns_per_lookup(stream_addrs, [&](uint64_t a) { return t.translate(a); });
+    printf("%10d %12.1f %12.1f %12.1f\n", n, scan_ns, random_ns, stream_ns);
+  }
+  return 0;
+}
@@ -0,0 +1,89 @@
+// Host <-> FPGA XDMA throughput for 4KB-1GB transfers out of a shared-memory segment, like the data server's
+// allocations. "bounce" is what MOVE_TO/FROM_FPGA used to do (an extra malloc + memcpy of the whole transfer), "direct"
+// DMAs straight to/from the segment on one channel, and "pool" splits the transfer over every channel (xdma_pool.h, see
+// BEETHOVEN_XDMA_CHANNELS and BEETHOVEN_XDMA_CHUNK_KB). Run with BEETHOVEN_XDMA_PIN=prefault or mlock to see what
+// pre-faulting buys.
+
+#include "fpga_utils.h"
+#include "xdma_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const uint64_t max_size = 1ull << 30;
+// device address that the transfers go to, anything that fits max_size will do
+static const uint64_t fpga_addr = 0;
+
+static double gbps(uint64_t bytes, std::chrono::steady_clock::duration d) {
+  return double(bytes) / 1e9 / std::chrono::duration<double>(d).count();
+}
+
+template<typename F>
+static double time_transfers(uint64_t size, F f) {
+  // at least 3 transfers, and at least 1GB total so that small sizes aren't all timer noise
+  uint64_t reps = std::max<uint64_t>(3, max_size / size);
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < reps; ++i) f();
+  return gbps(size * reps, std::chrono::steady_clock::now() - start);
+}
+
+int main() {
+  fpga_setup(0);
+  std::string name = "/beethoven_xdma_bench_" + std::to_string(getpid());
+  int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd < 0 || ftruncate(fd, max_size)) {
+    perror("shm");
+    return 1;
+  }
+  auto seg = (uint8_t *) mmap(nullptr, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  shm_unlink(name.c_str());
+  if (seg == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  const char *pin = getenv("BEETHOVEN_XDMA_PIN");
+  if (pin && !strcmp(pin, "mlock")) mlock(seg, max_size);
+  if (pin) memset(seg, 1, max_size);
+
+  printf("%10s %16s %16s %16s %16s %16s %16s\n", "size", "to bounce GB/s", "to direct GB/s", "to pool GB/s",
+         "from bounce GB/s", "from direct GB/s", "from pool GB/s");
+  for (uint64_t size = 4096; size <= max_size; size <<= 2) {
+    double to_bounce = time_transfers(size, [&] {
+      auto mem = (uint8_t *) malloc(size);
+      memcpy(mem, seg, size);
+      // the copy was never used, don't let the compiler notice
+      asm volatile("" ::"r"(mem) : "memory");
+      check_rc(wrapper_fpga_dma_burst_write(xdma_write_fd, seg, size, fpga_addr), "write");
+      free(mem);
+    });
+    double to_direct = time_transfers(size, [&] {
+      check_rc(wrapper_fpga_dma_burst_write(xdma_write_fd, seg, size, fpga_addr), "write");
+    });
+    double to_pool = time_transfers(size, [&] {
+      check_rc(xdma_pool::write(seg, size, fpga_addr), "write");
+    });
+    double from_bounce = time_transfers(size, [&] {
+      auto mem = (uint8_t *) malloc(size);
+      check_rc(wrapper_fpga_dma_burst_read(xdma_read_fd, mem, size, fpga_addr), "read");
+      memcpy(seg, mem, size);
+      free(mem);
+    });
+    double from_direct = time_transfers(size, [&] {
+      check_rc(wrapper_fpga_dma_burst_read(xdma_read_fd, seg, size, fpga_addr), "read");
+    });
+    double from_pool = time_transfers(size, [&] {
+      check_rc(xdma_pool::read(seg, size, fpga_addr), "read");
+    });
+    printf("%10lu %16.2f %16.2f %16.2f %16.2f %16.2f %16.2f\n", (unsigned long) size, to_bounce, to_direct, to_pool,
+           from_bounce, from_direct, from_pool);
+  }
+  fpga_shutdown();
+  return 0;
+}